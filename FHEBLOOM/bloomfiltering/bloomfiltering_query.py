@@ -28,12 +28,17 @@ if __name__ == '__main__':
     parser.add_argument("-q", type=int, default=BloomConfig.error_prob, help="False positive probability q [default: {}]".format(BloomConfig.error_prob))
     parser.add_argument("--qry", type=str, default=BloomConfig.vcf_qry, help="Path to the VCF file that contains query SNPs [default: {}]".format(BloomConfig.vcf_qry))
     parser.add_argument("--out", type=str, default=BloomConfig.outpath_qry, help="Path to the output directory where the databse Bloom filters are stored [default: {}]".format(BloomConfig.outpath_qry))
+    parser.add_argument("--tag", type=str, default=None, help="Add the query as query_<m>_<tag> to a query panel without removing the existing queries [default: None]")
     args = parser.parse_args()
 
-    # Clean
-    shutil.rmtree(args.out, ignore_errors=True)
-    os.makedirs(args.out)
-
-    qryFile = os.path.join(args.out, 'query_{}'.format(args.m))
+    if args.tag is None:
+        # Clean
+        shutil.rmtree(args.out, ignore_errors=True)
+        os.makedirs(args.out)
+        qryFile = os.path.join(args.out, 'query_{}'.format(args.m))
+    else:
+        if not os.path.exists(args.out):
+            os.makedirs(args.out)
+        qryFile = os.path.join(args.out, 'query_{}_{}'.format(args.m, args.tag))
     BloomConfig.writeToFile(qryFile, args.qry, args.m, args.q)
 
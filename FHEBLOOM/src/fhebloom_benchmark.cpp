@@ -0,0 +1,322 @@
+// File       fhebloom_benchmark.cpp
+// Brief      Benchmark harness of FHEBLOOM approach, writes the CSV files of phebloom_client.py.
+// 
+// Copyright  BLOOM: Bloom filter based outsourced oblivious matchings
+//            Copyright (C) 2017 Communication and Distributed Systems (COMSYS), RWTH Aachen
+//            
+//            This program is free software: you can redistribute it and/or modify
+//            it under the terms of the GNU Affero General Public License as published
+//            by the Free Software Foundation, either version 3 of the License, or
+//            (at your option) any later version.
+//            
+//            This program is distributed in the hope that it will be useful,
+//            but WITHOUT ANY WARRANTY; without even the implied warranty of
+//            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//            GNU Affero General Public License for more details.
+//            You should have received a copy of the GNU Affero General Public License
+//            along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#include <arpa/inet.h>
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <netinet/in.h>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+namespace po = boost::program_options;
+namespace fs = boost::filesystem;
+
+// One CSV row of phebloom_client.py: seconds, bytes and peak memory (ru_maxrss in KB)
+struct Measurement
+{
+    double secs = 0;
+    uintmax_t bytes = 0;
+    long mem = 0;
+};
+
+// Binaries and locations shared by all runs of the sweep
+struct Setup
+{
+    string client;
+    string server;
+    string builder;
+    string db;
+    string qry;
+    fs::path work;
+    int port;
+};
+
+vector<long> parseList(string list)
+{
+    vector<long> values;
+    stringstream stream(list);
+    string value;
+    while (getline(stream, value, ','))
+        if (!value.empty())
+            values.push_back(stol(value));
+    return values;
+}
+
+uintmax_t directoryBytes(fs::path path)
+{
+    uintmax_t bytes = 0;
+    if (fs::exists(path))
+        for (fs::recursive_directory_iterator it(path), end; it != end; ++it)
+            if (fs::is_regular_file(it->status()))
+                bytes += fs::file_size(it->path());
+    return bytes;
+}
+
+// Starts a binary with OMP_NUM_THREADS set and its output appended to the log
+pid_t spawn(const vector<string>& arguments, int threads, string log)
+{
+    pid_t pid = fork();
+    if (pid < 0)
+        throw runtime_error("Could not start " + arguments.front());
+
+    if (pid == 0)
+    {
+        setenv("OMP_NUM_THREADS", to_string(threads).c_str(), 1);
+        int fd = open(log.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd >= 0)
+        {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+
+        vector<char *> argv;
+        for (const string& argument : arguments)
+            argv.push_back(const_cast<char *>(argument.c_str()));
+        argv.push_back(nullptr);
+        execv(argv.front(), argv.data());
+        _exit(127);
+    }
+    return pid;
+}
+
+// Runs a binary to completion, the peak memory is the child's own
+Measurement run(const vector<string>& arguments, int threads, string log)
+{
+    auto start = chrono::steady_clock::now();
+    pid_t pid = spawn(arguments, threads, log);
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0)
+        throw runtime_error("Could not wait for " + arguments.front());
+
+    Measurement result;
+    result.secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    result.mem = usage.ru_maxrss;
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        throw runtime_error(arguments.front() + " failed, see " + log);
+    return result;
+}
+
+void waitForPort(int port)
+{
+    for (int attempt = 0; attempt < 100; attempt++)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(static_cast<uint16_t>(port));
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        bool connected = connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0;
+        close(fd);
+        if (connected)
+            return;
+        this_thread::sleep_for(chrono::milliseconds(100));
+    }
+    throw runtime_error("fhebloom_server does not listen on port " + to_string(port));
+}
+
+// One benchmark run: keys, database and qrycnt queries through the local client and server over TCP
+map<string, Measurement> benchmark(const Setup& setup, long m, long n, long q, int threads, int qrycnt)
+{
+    fs::path clientDir = setup.work / "client";
+    fs::path serverDir = setup.work / "server";
+    fs::path bloomDb = setup.work / "bloom_database";
+    fs::path bloomQry = setup.work / "bloom_query";
+    string log = (setup.work / "benchmark.log").string();
+
+    for (const fs::path& path : {clientDir, serverDir, bloomDb, bloomQry})
+    {
+        fs::remove_all(path);
+        fs::create_directories(path);
+    }
+
+    string dirClient = clientDir.string() + "/";
+    string dirServer = serverDir.string() + "/";
+    ostringstream errorRate;
+    errorRate.precision(17);
+    errorRate << pow(2.0, q);
+
+    vector<string> client = {setup.client, "--dir_client", dirClient, "--dir_server", dirServer, "--transport", "tcp", "--tcp_port", to_string(setup.port)};
+    auto clientCall = [&client](vector<string> arguments)
+    {
+        arguments.insert(arguments.begin(), client.begin(), client.end());
+        return arguments;
+    };
+
+    pid_t server = spawn({setup.server, "--listen", to_string(setup.port), "--dir_server", dirServer}, threads, log);
+    map<string, Measurement> results;
+    try
+    {
+        waitForPort(setup.port);
+        run(clientCall({"--generate_key"}), threads, log);
+        run(clientCall({"--upload_key"}), threads, log);
+
+        Measurement& blooming = results["c_db_blooming"] = run({setup.builder, "--db", setup.db, "--out_db", bloomDb.string() + "/",
+                                                                "--n", to_string(n), "--m", to_string(m), "--q", errorRate.str()}, threads, log);
+        blooming.bytes = directoryBytes(bloomDb);
+
+        Measurement& encrypt = results["c_db_encrypt"] = run(clientCall({"--db_bloom", bloomDb.string() + "/"}), threads, log);
+        encrypt.bytes = directoryBytes(clientDir / "fhebloom_client_database");
+
+        Measurement& upload = results["c_db_upload"] = run(clientCall({"--upload_db"}), threads, log);
+        upload.bytes = directoryBytes(serverDir / "fhebloom_server_database");
+
+        for (int i = 0; i < qrycnt; i++)
+        {
+            string suffix = "_" + to_string(i);
+            cout << "[BEN] Query " << i << endl;
+
+            Measurement& qryBlooming = results["c_qry_blooming" + suffix] = run({setup.builder, "--qry", setup.qry, "--out_qry", bloomQry.string() + "/",
+                                                                                 "--m", to_string(m), "--q", errorRate.str()}, threads, log);
+            qryBlooming.bytes = directoryBytes(bloomQry);
+
+            Measurement& qryEncrypt = results["c_qry_encrypt" + suffix] = run(clientCall({"--qry_bloom", bloomQry.string() + "/"}), threads, log);
+            qryEncrypt.bytes = directoryBytes(clientDir / "fhebloom_client_query");
+
+            Measurement& qryUpload = results["c_qry_upload" + suffix] = run(clientCall({"--upload_qry"}), threads, log);
+            qryUpload.bytes = directoryBytes(serverDir / "fhebloom_server_query");
+
+            Measurement& execute = results["s_execute" + suffix] = run({setup.server, "--run", "--dir_server", dirServer}, threads, log);
+            execute.bytes = directoryBytes(serverDir / "fhebloom_server_result");
+
+            Measurement& download = results["c_qry_download" + suffix] = run(clientCall({"--download"}), threads, log);
+            download.bytes = directoryBytes(clientDir / "fhebloom_client_result");
+
+            results["c_qry_decrypt" + suffix] = run(clientCall({"--decrypt"}), threads, log);
+        }
+    }
+    catch (...)
+    {
+        kill(server, SIGTERM);
+        waitpid(server, nullptr, 0);
+        throw;
+    }
+
+    kill(server, SIGTERM);
+    waitpid(server, nullptr, 0);
+    return results;
+}
+
+// Same name and rows as phebloom_client.py, the server uses as many threads as the client
+void writeCsv(fs::path directory, const map<string, Measurement>& results, long m, long n, long q, int threads, int r, int qrycnt)
+{
+    ostringstream name;
+    name << "III_m" << m << "_n" << n << "_q" << q << "_Cc" << threads << "_Cs" << threads << ".r" << r;
+
+    vector<string> rows = {"c_db_blooming", "c_db_encrypt", "c_db_upload"};
+    for (int i = 0; i < qrycnt; i++)
+        for (string key : {"c_qry_blooming", "c_qry_encrypt", "c_qry_upload", "s_execute", "c_qry_download", "c_qry_decrypt"})
+            rows.push_back(key + "_" + to_string(i));
+
+    fs::create_directories(directory);
+    ofstream file((directory / name.str()).string());
+    for (const string& row : rows)
+    {
+        const Measurement& result = results.at(row);
+        file << row << "," << result.secs << "," << result.bytes << "," << result.mem << "\n";
+    }
+    cout << "[BEN] Wrote " << (directory / name.str()).string() << endl;
+}
+
+int main(int argc, char* argv[])
+{
+    fs::path binaries = fs::system_complete(argv[0]).parent_path();
+
+    po::variables_map vm;
+    po::options_description desc("Allowed options");
+    desc.add_options()
+            ("help", "produce help message")
+
+            ("n", po::value<string>()->default_value("1"), "Comma separated numbers of patients n [default: 1]")
+            ("m", po::value<string>()->default_value("10000"), "Comma separated numbers of SNPs m per patient [default: 10000]")
+            ("q", po::value<string>()->default_value("-14"), "Comma separated false positive probabilities 2**q [default: -14]")
+            ("Cc", po::value<string>()->default_value(to_string(max(1u, thread::hardware_concurrency()))), "Comma separated thread counts of client and server [default: all the CPUs]")
+            ("r", po::value<int>()->default_value(0), "Number of the first run, every repetition increments it [default: 0]")
+            ("runs", po::value<int>()->default_value(1), "Repetitions of every configuration [default: 1]")
+            ("qrycnt", po::value<int>()->default_value(3), "Number of queries repetitions to send [default: 3]")
+
+            ("db", po::value<string>()->default_value("data/vcf_database/"), "Path to the directory that contains the VCF patient files [default: data/vcf_database/]")
+            ("qry", po::value<string>()->default_value("data/vcf_query/multi_query.vcf"), "Path to the VCF file that contains query SNPs [default: data/vcf_query/multi_query.vcf]")
+            ("work", po::value<string>()->default_value("/tmp/fhebloom_benchmark/"), "Path to the client and server processing directories [default: /tmp/fhebloom_benchmark/]")
+            ("out", po::value<string>()->default_value("."), "Path to the directory the CSV files are written to [default: .]")
+            ("tcp_port", po::value<int>()->default_value(7767), "Port the local fhebloom_server listens on [default: 7767]")
+            ("bin", po::value<string>()->default_value(binaries.string()), "Path to fhebloom_client, fhebloom_server and fhebloom_builder [default: next to this binary]")
+            ;
+
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+
+    if (vm.count("help"))
+    {
+        cout << desc << "\n";
+        return 1;
+    }
+
+    Setup setup;
+    fs::path bin(vm["bin"].as<string>());
+    setup.client = (bin / "fhebloom_client").string();
+    setup.server = (bin / "fhebloom_server").string();
+    setup.builder = (bin / "fhebloom_builder").string();
+    setup.db = fs::system_complete(vm["db"].as<string>()).string();
+    setup.qry = fs::system_complete(vm["qry"].as<string>()).string();
+    setup.work = fs::system_complete(vm["work"].as<string>());
+    setup.port = vm["tcp_port"].as<int>();
+    fs::create_directories(setup.work);
+
+    int qrycnt = vm["qrycnt"].as<int>();
+    int failures = 0;
+
+    for (long m : parseList(vm["m"].as<string>()))
+        for (long n : parseList(vm["n"].as<string>()))
+            for (long q : parseList(vm["q"].as<string>()))
+                for (long threads : parseList(vm["Cc"].as<string>()))
+                    for (int r = vm["r"].as<int>(); r < vm["r"].as<int>() + vm["runs"].as<int>(); r++)
+                    {
+                        cout << "[BEN] >> m=" << m << " n=" << n << " q=" << q << " Cc=" << threads << " r=" << r << endl;
+                        try
+                        {
+                            map<string, Measurement> results = benchmark(setup, m, n, q, static_cast<int>(threads), qrycnt);
+                            writeCsv(vm["out"].as<string>(), results, m, n, q, static_cast<int>(threads), r, qrycnt);
+                        }
+                        catch (const exception& e)
+                        {
+                            cout << "[BEN] " << e.what() << endl;
+                            failures++;
+                        }
+                    }
+
+    return failures ? -1 : 0;
+}
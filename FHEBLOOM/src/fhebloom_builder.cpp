@@ -0,0 +1,168 @@
+// File       fhebloom_builder.cpp
+// Brief      Native VCF to Bloom filter preprocessing of FHEBLOOM approach, replaces the bloomfiltering scripts.
+// 
+// Copyright  BLOOM: Bloom filter based outsourced oblivious matchings
+//            Copyright (C) 2017 Communication and Distributed Systems (COMSYS), RWTH Aachen
+//            
+//            This program is free software: you can redistribute it and/or modify
+//            it under the terms of the GNU Affero General Public License as published
+//            by the Free Software Foundation, either version 3 of the License, or
+//            (at your option) any later version.
+//            
+//            This program is distributed in the hope that it will be useful,
+//            but WITHOUT ANY WARRANTY; without even the implied warranty of
+//            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//            GNU Affero General Public License for more details.
+//            You should have received a copy of the GNU Affero General Public License
+//            along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+#include <exception>
+#include <iostream>
+#include <omp.h>
+#include <string>
+#include "fhebloom_vcf.h"
+
+using namespace std;
+namespace po = boost::program_options;
+namespace fs = boost::filesystem;
+namespace bl = bloomLib;
+
+long buildBloomFile(const bl::BloomBuilder& builder, string vcf, string outpath)
+{
+    #pragma omp critical
+    cout << "[BLD] >> Building: " << vcf << endl;
+
+    vector<unsigned char> bits(builder.parameters().numberBytes(), 0);
+    long snps = builder.addVcf(vcf, bits);
+    bl::writeBloomFile(outpath, bits);
+
+    #pragma omp critical
+    {
+        if (snps > builder.parameters().capacity)
+            cout << "[BLD] WARNING: " << vcf << " has " << snps << " SNPs, more than the capacity m = " << builder.parameters().capacity << endl;
+        cout << "[BLD] <<   Finished: " << outpath << " - " << snps << " SNPs" << endl;
+    }
+
+    return snps;
+}
+
+int main(int argc, char* argv[])
+{
+    po::variables_map vm;
+    po::options_description desc("Allowed options");
+    desc.add_options()
+            ("help", "produce help message")
+
+            ("n", po::value<int>()->default_value(1), "Number of patients n [default: 1]")
+            ("m", po::value<long>()->default_value(bl::vcf_capacity), "Number of SNPs m per patient [default: 10000]")
+            ("q", po::value<double>()->default_value(bl::vcf_error_prob), "False positive probability q [default: 1/16384]")
+            ("block", po::value<long>()->default_value(0), "Blocked Bloom filter, all bits of a SNP fall into one block of this many bits, use the number of slots nslots so a query touches one chunk per SNP [default: 0, standard]")
+            ("fpr", "Print size and false positive rate of the standard and the blocked filter and exit")
+
+            ("db", po::value<string>()->implicit_value("data/vcf_database/"), "Path to the directory that contains the VCF patient files [default: data/vcf_database/]")
+            ("pattern", po::value<string>(), "Pattern the VCF patients have to match [default: *_<m>.vcf]")
+            ("out_db", po::value<string>()->default_value("data/bloom_database/"), "Path to the output directory where the database Bloom filters are stored [default: data/bloom_database/]")
+
+            ("qry", po::value<string>()->implicit_value("data/vcf_query/multi_query.vcf"), "Path to the VCF file that contains query SNPs [default: data/vcf_query/multi_query.vcf]")
+            ("out_qry", po::value<string>()->default_value("data/bloom_query/"), "Path to the output directory where the query Bloom filter is stored [default: data/bloom_query/]")
+            ("tag", po::value<string>(), "Add the query as query_<m>_<tag> to a query panel without removing the existing queries")
+            ;
+
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+
+    if (vm.count("help") || !(vm.count("db") || vm.count("qry") || vm.count("fpr")))
+    {
+        cout << desc << "\n";
+        return 1;
+    }
+
+    long m = vm["m"].as<long>();
+
+    if (vm.count("fpr"))
+    {
+        bl::BloomParameters standard = bl::bloomParameters(m, vm["q"].as<double>());
+        cout << "[BLD] Standard: " << standard.numberBits() << " bits, " << standard.numberSlices << " hashes, false positive rate "
+             << bl::falsePositiveRate(m, standard.numberSlices, standard.bitsPerSlice) << endl;
+
+        if (vm["block"].as<long>() > 0)
+        {
+            bl::BloomParameters blocked = bl::bloomParameters(m, vm["q"].as<double>(), vm["block"].as<long>());
+            cout << "[BLD] Blocked:  " << blocked.numberBits() << " bits, " << blocked.numberBlocks << " blocks of " << blocked.blockBits << " bits, "
+                 << blocked.hashes << " hashes, false positive rate " << bl::blockedFalsePositiveRate(m, blocked.numberBlocks, blocked.blockBits, blocked.hashes) << endl;
+        }
+        return 0;
+    }
+
+    bl::BloomBuilder builder(m, vm["q"].as<double>(), vm["block"].as<long>());
+    if (builder.parameters().blocked())
+        cout << "[BLD] Blocked Bloom filter: " << builder.parameters().numberBlocks << " blocks of " << builder.parameters().blockBits << " bits, " << builder.parameters().hashes << " hashes" << endl;
+    else
+        cout << "[BLD] Bloom filter: " << builder.parameters().numberSlices << " slices of " << builder.parameters().bitsPerSlice << " bits" << endl;
+
+    if (vm.count("db"))
+    {
+        string pattern = vm.count("pattern") ? vm["pattern"].as<string>() : "*_" + to_string(m) + ".vcf";
+        string outpath = vm["out_db"].as<string>();
+
+        // directory order, so patient indices match bloomfiltering_database.py
+        vector<string> vcfList = bl::enumerateVcf(vm["db"].as<string>(), pattern);
+
+        if (vcfList.empty())
+        {
+            cout << "[BLD] ERROR: No (database) files in input directory" << endl;
+            return -1;
+        }
+        if (vm["n"].as<int>() >= 0 && vm["n"].as<int>() < (int) vcfList.size())
+            vcfList.resize(vm["n"].as<int>());
+
+        // Clean
+        fs::remove_all(outpath);
+        fs::create_directories(outpath);
+
+        // many small files are built side by side, otherwise the blocks of each file are parsed in parallel,
+        // the first error is rethrown after the loop as exceptions must not leave it
+        exception_ptr failure;
+        #pragma omp parallel for schedule(dynamic,1) if((int) vcfList.size() >= omp_get_max_threads())
+        for (int ind = 0; ind < (int) vcfList.size(); ind++)
+        {
+            try
+            {
+                buildBloomFile(builder, vcfList.at(ind), (fs::path(outpath) / ("database_" + to_string(ind) + "_" + to_string(m))).string());
+            }
+            catch (...)
+            {
+                #pragma omp critical
+                if (!failure)
+                    failure = current_exception();
+            }
+        }
+        if (failure)
+            rethrow_exception(failure);
+    }
+
+    if (vm.count("qry"))
+    {
+        string outpath = vm["out_qry"].as<string>();
+        string qryFile;
+
+        if (!vm.count("tag"))
+        {
+            // Clean
+            fs::remove_all(outpath);
+            fs::create_directories(outpath);
+            qryFile = "query_" + to_string(m);
+        }
+        else
+        {
+            fs::create_directories(outpath);
+            qryFile = "query_" + to_string(m) + "_" + vm["tag"].as<string>();
+        }
+
+        buildBloomFile(builder, vm["qry"].as<string>(), (fs::path(outpath) / qryFile).string());
+    }
+
+    return 0;
+}
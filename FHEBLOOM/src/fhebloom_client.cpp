@@ -21,13 +21,21 @@
 
 #include <EncryptedArray.h>
 #include <bitset>
+#include <exception>
+#include <memory>
+#include <set>
 #include <boost/algorithm/string.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/program_options.hpp>
 #include <boost/regex.hpp>
+#include <omp.h>
 #include <string>
 #include <unistd.h>
 #include "fhebloom_config.h"
+#include "fhebloom_metrics.h"
+#include "fhebloom_net.h"
+#include "fhebloom_planner.h"
+#include "fhebloom_vcf.h"
 #include "commandline.h"
 
 using namespace std;
@@ -37,7 +45,8 @@ namespace bl = bloomLib;
 
 void generateKeys(long m, long p, long r, long L, long c, long w, long d, long security, string public_path, string private_path)
 {
-    m = FindM(security,L,c,p, d, 0, 0);
+    if (m == 0)
+        m = FindM(security,L,c,p, d, 0, 0);
 
     FHEcontext context(m, p, r);
     // initialize context
@@ -84,112 +93,226 @@ void generateKeys(long m, long p, long r, long L, long c, long w, long d, long s
 
         publicFile.close();
     }
+
+    // binary snapshots let later runs skip parsing the text keys
+    ZZX G = context.alMod.getFactorsOverZZ()[0];
+    bl::writeKeySnapshot(public_path + bl::public_snapshot_file, context, G, publicKey, false);
+    bl::writeKeySnapshot(private_path + bl::secret_snapshot_file, context, G, secretKey, true);
+}
+
+unique_ptr<bl::BloomFile> openBloom(string source, const bl::BloomBuilder *builder)
+{
+    // VCFs are parsed straight into memory, no intermediate Bloom file is written
+    if (builder != nullptr)
+        return unique_ptr<bl::BloomFile>(new bl::BloomFile(builder->buildFromVcf(source)));
+    return unique_ptr<bl::BloomFile>(new bl::BloomFile(source));
+}
+
+unique_ptr<bl::BloomFile> openBloom(string source, const bl::BloomBuilder *builder, exception_ptr& failure)
+{
+    // inside an OpenMP loop the first error is kept for after the loop, the failed file yields nullptr
+    try
+    {
+        return openBloom(source, builder);
+    }
+    catch (...)
+    {
+        #pragma omp critical
+        if (!failure)
+            failure = current_exception();
+        return nullptr;
+    }
 }
 
-bool getBit(unsigned char byte, int position) // position in range 0-7
+bool parallelAcrossFiles(size_t numberFiles, uint32_t chunksPerFile)
 {
-    return (byte >> position) & 0x1;
+    // files with fewer chunks than threads are encrypted side by side, larger ones chunk by chunk
+    return numberFiles > 1 && (int) chunksPerFile < omp_get_max_threads();
 }
 
+uint32_t chunksPerFile(string source, const bl::BloomBuilder *builder, long nslots)
+{
+    if (builder != nullptr)
+        return static_cast<uint32_t>((builder->parameters().numberBits() + nslots - 1) / nslots);
+    return bl::BloomFile(source).chunkCount(nslots);
+}
 
-int loadBloomFile(string path, vector<bool> &bloom)
+bl::ManifestEntry encryptBloomfilter(EncryptedArray& ea, const FHEPubKey& publicKey, const bl::BloomFile& bloom, string path, string prefix, bool compress)
 {
 
-    ifstream bloomFile;
-    bloomFile.open(path, ifstream::binary);
-    int setBits = 0;
+    boost::replace_all(path, "//", "/");
+
+    #pragma omp critical
+    cout << "[CLT] >> Encrypting: " << path << endl;
 
-    //cout << "Open File " << path << endl;
-    if(bloomFile.is_open())
-    {
-        //cout << "File is opened" << endl;
+    // all chunks of one Bloom filter go into a single container
+    uint32_t numberChunks = bloom.chunkCount(ea.size());
+    bl::CtxtContainerWriter container(prefix + ".enc", numberChunks, compress);
 
-        bloomFile.seekg (0, bloomFile.end);
-        int length = bloomFile.tellg();
-        bloomFile.seekg (0, bloomFile.beg);
+    // decoding and encryption of consecutive chunks overlap, the ordered append keeps one chunk per thread in flight
+    #pragma omp parallel
+    {
+        vector<long> slots(ea.size());
 
-        int currentChar = 0;
-        //Do NOT use eof for binary files
-        while (currentChar < length)
+        #pragma omp for ordered schedule(static,1)
+        for (int i = 0; i < (int) numberChunks; i++)
         {
-            // read returns a byte
-            char b;
-
-            bloomFile.read(&b, 1);
-            // we use bits! Count down here!
-            for(int i = 7; i >= 0; i--)
+            bloom.decodeChunk(i, slots);
+            Ctxt ctChunk(publicKey);
             {
-                bool bit = getBit(b, i);
-                bloom.push_back(bit);
-                setBits += bit;
+                bl::StepTimer timer(bl::step_encrypt);
+                ea.encrypt(ctChunk, publicKey, slots);
+                // only the one match multiplication is left, the primes above its base level are shipped for nothing
+                bl::modDownToBaseLevel(ctChunk);
             }
-            currentChar++;
+            string serialized = bl::serializeCtxt(ctChunk, compress);
+
+            #pragma omp ordered
+            container.append(serialized);
         }
     }
+    uint64_t bytes = container.close();
 
-//    cout << "Bloomfilter has size " << bloom.size() << endl;
-//    cout << bloom << endl;
-    return setBits;
+    int p = prefix.find_last_of("/");
+
+    #pragma omp critical
+    cout << "[CLT] <<   Finished: " << prefix.substr(p+1) << ".enc - " << bloom.setBits() << endl;
+
+    return bl::ManifestEntry{prefix.substr(p+1), numberChunks, bytes};
 }
 
+bl::ManifestEntry encryptEmptyVector(EncryptedArray& ea, const FHEPubKey& publicKey, string prefix, bool compress)
+{
+    bl::CtxtContainerWriter container(prefix + ".enc", 1, compress);
+    Ctxt ctEmpty(publicKey);
+    ea.encrypt(ctEmpty, publicKey, vector<long>(ea.size(), 0));
+    bl::modDownToBaseLevel(ctEmpty);
+    container.append(ctEmpty);
+    uint64_t bytes = container.close();
+
+    int p = prefix.find_last_of("/");
+    return bl::ManifestEntry{prefix.substr(p+1), 1, bytes};
+}
 
-vector<vector<long>> splitVector(vector<bool> bloom, int chunkSize)
+bl::ManifestEntry encryptColumns(EncryptedArray& ea, const FHEPubKey& publicKey, const vector<vector<bool>>& blooms, string prefix, bool compress)
 {
-    vector<vector<long>> bloomChunks;
-    double chunkCount = static_cast<double>(bloom.size())/static_cast<double>(chunkSize);
-    for (int i=0; i < ceil(chunkCount); i++)
-    {
-        vector<bool>::iterator startIterator = bloom.begin()+i*chunkSize;
-        vector<bool>::iterator endIterator = bloom.begin()+(i+1)*chunkSize;
-        if ((i+1)*chunkSize >= (int) bloom.size())
-        {
-            endIterator = bloom.end();
+    // chunk b holds Bloom bit b of all patients in the group, patient s in slot s
+    size_t length = 0;
+    for (const vector<bool>& bloom : blooms)
+        length = max(length, bloom.size());
 
-            vector<long> temp = vector<long>(startIterator, endIterator);
-            while ((int) temp.size() < chunkSize)
-            {
-                temp.push_back(false);
-            }
-            bloomChunks.push_back(temp);
+    int p = prefix.find_last_of("/");
 
-        }
-        else
+    #pragma omp critical
+    cout << "[CLT] >> Encrypting: " << prefix.substr(p+1) << " with " << blooms.size() << " patients" << endl;
+
+    bl::CtxtContainerWriter container(prefix + ".enc", static_cast<uint32_t>(length), compress);
+
+    // positions are encrypted in parallel but appended in order
+    #pragma omp parallel for ordered schedule(static,1)
+    for (int b = 0; b < (int) length; b++)
+    {
+        vector<long> slots(ea.size(), 0);
+        for (size_t s = 0; s < blooms.size(); s++)
+            slots.at(s) = b < (int) blooms.at(s).size() ? blooms.at(s).at(b) : 0;
+
+        Ctxt ctChunk(publicKey);
         {
-            bloomChunks.push_back(vector<long>(startIterator, endIterator));
+            bl::StepTimer timer(bl::step_encrypt);
+            ea.encrypt(ctChunk, publicKey, slots);
+            bl::modDownToBaseLevel(ctChunk);
         }
+        string serialized = bl::serializeCtxt(ctChunk, compress);
 
+        #pragma omp ordered
+        container.append(serialized);
     }
+    uint64_t bytes = container.close();
 
-    //cout << bloomChunks.size() << " chunks with size " << chunkSize << endl;
+    #pragma omp critical
+    cout << "[CLT] <<   Finished: " << prefix.substr(p+1) << ".enc" << endl;
 
-    return bloomChunks;
+    return bl::ManifestEntry{prefix.substr(p+1), static_cast<uint32_t>(length), bytes};
 }
 
-void encryptBloomfilter(EncryptedArray& ea, const FHEPubKey& publicKey, vector<vector<long>>& cur_vector, string path, string prefix, int setBits)
+map<string, vector<string>> loadColumnLayout(string path)
 {
+    // every line: <group> <patient 0> <patient 1> ...
+    map<string, vector<string>> layout;
+    fstream layoutFile(path + bl::column_layout_file, fstream::in);
 
-    boost::replace_all(path, "//", "/");
-
-    if (path.compare("") != 0)
-        #pragma omp critical
-        cout << "[CLT] >> Encrypting: " << path << endl;
-
-    for(vector<vector<long>>::iterator it = cur_vector.begin(); it != cur_vector.end(); it++)
+    string line;
+    while (getline(layoutFile, line))
     {
-        stringstream filename;
-        filename << prefix << "_ct_chunk_" << distance(cur_vector.begin(), it) << ".enc";
-        fstream ctChunkFile(filename.str(), fstream::out|fstream::trunc);
-        Ctxt ctChunk(publicKey);
-        ea.encrypt(ctChunk, publicKey, *it);
-        ctChunkFile << ctChunk;
-        ctChunkFile.close();
+        stringstream fields(line);
+        string group, patient;
+        fields >> group;
+        while (fields >> patient)
+            layout[group].push_back(patient);
     }
 
-    int p = prefix.find_last_of("/");
+    return layout;
+}
 
-    if (path.compare("") != 0)
-        #pragma omp critical
-        cout << "[CLT] <<   Finished: " << prefix.substr(p+1) << ".enc - " << setBits << endl;
+map<string, string> loadVcfSources(string filename)
+{
+    // every line: <patient> <VCF>
+    map<string, string> sources;
+    fstream sourcesFile(filename, fstream::in);
+
+    string patient, vcf;
+    while (sourcesFile >> patient && getline(sourcesFile >> ws, vcf))
+        sources[patient] = vcf;
+
+    return sources;
+}
+
+void streamFile(bl::Uploader *uploader, string localDirectory, string remoteDirectory, string filename)
+{
+    // containers are uploaded as soon as they are complete while encryption continues
+    if (uploader != nullptr)
+        uploader->enqueue(localDirectory + filename, remoteDirectory + filename);
+}
+
+unique_ptr<bl::Uploader> startStream(const po::variables_map& vm, string remoteDirectory, bool incremental = false)
+{
+    if (!vm.count("stream"))
+        return nullptr;
+
+    cout << "[CLT] Streaming to: " << vm["a"].as<string>() << "[" << vm["tcp_port"].as<int>() << "]" << endl;
+    unique_ptr<bl::Uploader> uploader(new bl::Uploader(vm["a"].as<string>(), vm["tcp_port"].as<int>()));
+
+    // an incremental update keeps the server's containers, only its manifest is withdrawn until the update is complete
+    if (incremental)
+        uploader->remove(remoteDirectory + bl::manifest_file);
+    else
+        uploader->clear(remoteDirectory);
+    return uploader;
+}
+
+void finishStream(bl::Uploader *uploader, string localDirectory, string remoteDirectory)
+{
+    if (uploader == nullptr)
+        return;
+
+    // the manifest goes last, the server only picks up complete uploads
+    streamFile(uploader, localDirectory, remoteDirectory, bl::manifest_file);
+    uint64_t bytes = uploader->finish();
+    cout << "[CLT] Streamed " << bytes << " bytes to " << remoteDirectory << endl;
+}
+
+set<string> splitNames(const po::variables_map& vm, string option)
+{
+    set<string> names;
+    if (vm.count(option))
+    {
+        vector<string> fields;
+        boost::split(fields, vm[option].as<string>(), boost::is_any_of(","), boost::token_compress_on);
+        for (const string& field : fields)
+            if (!field.empty())
+                names.insert(field);
+    }
+    return names;
 }
 
 void create_dir(string path, string pattern)
@@ -208,6 +331,13 @@ void upload_rsync(string output, string client, string server, string host, stri
     send_files_commandline(host.c_str(), user.c_str(), port, client.c_str(), server.c_str());
 }
 
+void upload_tcp(string output, string client, string server, string host, int port)
+{
+    cout << "[CLT] Uploading " << output << " to: " << host << "[" << port << "]" << endl;
+    int files = bl::uploadDirectory(host, port, client, server);
+    cout << "[CLT] Uploaded " << files << " files" << endl;
+}
+
 void download_rsync(string client, string server, string host, string user, int port)
 {
     cout << "[SRV] Downloading results from: "<< user << "@" << host << "[" <<  port << "]"  << endl;
@@ -231,24 +361,52 @@ int main(int argc, char* argv[])
     desc.add_options()
             ("help", "produce help message")
             ("generate_key", "generates a new key")
+            ("plan", "Benchmark HElib parameters for --vcf_m SNPs, --vcf_q and --patients and print the cheapest, combine with --generate_key to use them")
+            ("patients", po::value<long>()->default_value(1), "Number of patients n in the cohort [use with --plan, default: 1]")
+            ("security", po::value<long>()->default_value(bl::security), "Security bits [use with --plan/--generate_key, default: 80]")
+            ("plaintext_modulus", po::value<long>()->default_value(bl::p), "Plaintext modulus p, has to exceed the largest match count [use with --generate_key, default: 59]")
+            ("levels", po::value<long>()->default_value(bl::L), "Levels L of the modulus chain [use with --generate_key, default: 3]")
+            ("cyclotomic", po::value<long>()->default_value(0), "Cyclotomic index m, 0: smallest m for the security level [use with --generate_key, default: 0]")
 
             ("db_bloom", po::value<string>()->implicit_value(fs::system_complete("data/bloom_database").string()), "Path to the directory that contains the preprocessed patient files [default: data/bloom_database/]")
             ("qry_bloom", po::value<string>()->implicit_value(fs::system_complete("data/bloom_query").string()), "Path to the directory that contains the preprocessed query file [default: data/bloom_query/]")
+            ("db_vcf", po::value<string>(), "Path to a directory of patient VCF files, Bloom filters are built in memory and encrypted directly")
+            ("qry_vcf", po::value<string>(), "Path to a query VCF file, the Bloom filter is built in memory and encrypted directly")
+            ("vcf_pattern", po::value<string>()->default_value("*.vcf"), "Pattern the patient VCF files have to match [use with --db_vcf, default: *.vcf]")
+            ("vcf_m", po::value<long>()->default_value(bl::vcf_capacity), "Number of SNPs m per patient [use with --db_vcf/--qry_vcf, default: 10000]")
+            ("vcf_q", po::value<double>()->default_value(bl::vcf_error_prob), "False positive probability q [use with --db_vcf/--qry_vcf, default: 1/16384]")
+            ("blocked", "Build blocked Bloom filters with one block per chunk, a query SNP touches a single chunk [use with --db_vcf/--qry_vcf]")
             ("dir_client", po::value<string>()->default_value("/tmp/"), "Path to the client processing directory [default: /tmp/]")
             ("dir_server", po::value<string>()->default_value("/tmp/"), "Path to the server processing directory [default: /tmp/]")
+            ("update", "Keep the encrypted database and only encrypt patients that are not in it yet [use with --db_bloom/--db_vcf]")
+            ("replace", po::value<string>(), "Re-encrypt these comma separated patients, e.g. database_3_10000 [use with --db_bloom/--db_vcf]")
+            ("remove", po::value<string>(), "Remove these comma separated patients from the encrypted database")
+            ("layout", po::value<string>()->default_value("row"), "Database layout, row: one patient per ciphertext, column: one Bloom position of up to nslots patients per ciphertext [default: row]")
+
+            ("plain_query", "Send the query Bloom filter unencrypted [RELAXED SECURITY: the server learns the query]")
+            ("compress", "Store the encrypted database and query compressed, a modest saving of about 14% of the bytes to upload [use with --db_bloom/--db_vcf/--qry_bloom/--qry_vcf]")
 
             ("upload_db", "Upload encrypted database to server")
             ("upload_key", "Upload public key to server")
             ("upload_qry", "Upload encrypted query to server")
 
             ("execute", "Perform calculation locally [DO NOT USE DURING EVAL!]")
+            ("eager_relin", "relinearize every product instead of once per patient [use with --execute]")
+            ("unpacked_results", "store one result ciphertext per patient instead of packing all counts [use with --execute]")
+            ("tasks_per_patient", po::value<int>()->default_value(0), "number of chunk ranges matched in parallel per patient, 0 uses twice the thread count [use with --execute]")
             ("decrypt", "Decrypt server result")
             ("download", "Download encrypted results from server")
             
+            ("transport", po::value<string>()->default_value("rsync"), "rsync: rsync over ssh, tcp: native transfer to fhebloom_server --listen [default: rsync]")
+            ("tcp_port", po::value<int>()->default_value(bl::default_transfer_port), "port of fhebloom_server --listen [use with --transport tcp, default: 7766]")
+            ("stream", "Upload every container as soon as it is encrypted, implies --transport tcp [use with --db_bloom/--db_vcf/--qry_bloom/--qry_vcf]")
+
             ("a", po::value<string>()->default_value("127.0.0.1"), "address to connect to [default: localhost]")
             ("p", po::value<int>()->default_value(22), "port to connect to [default: 22]")
             ("u", po::value<string>()->default_value(string(getlogin())), "user to connect with [default: current]")
 
+            ("metrics", po::value<string>(), "Write step timings as <prefix>.json and Prometheus text <prefix>.prom at the end of the run")
+
             ;
 
     po::store(po::parse_command_line(argc, argv, desc), vm);
@@ -260,12 +418,40 @@ int main(int argc, char* argv[])
         return 1;
     }
 
+    long p = vm["plaintext_modulus"].as<long>();
+    long L = vm["levels"].as<long>();
+    long security = vm["security"].as<long>();
+    m = vm["cyclotomic"].as<long>();
+
+    if (vm.count("plan"))
+    {
+        bl::PlannerInput input;
+        input.snps = vm["vcf_m"].as<long>();
+        input.errorRate = vm["vcf_q"].as<double>();
+        input.patients = vm["patients"].as<long>();
+        input.security = security;
+        input.columnLayout = vm["layout"].as<string>() == "column";
+        input.c = c;
+        input.w = w;
+
+        cout << "[CLT] Planning parameters for " << input.patients << " patients with " << input.snps << " SNPs at " << security << " bit security" << endl;
+        bl::KeyParameters plan = bl::planParameters("[CLT]", input);
+        m = plan.m;
+        p = plan.p;
+        r = plan.r;
+        L = plan.L;
+        cout << "[CLT] Plan: --security " << security << " --plaintext_modulus " << p << " --levels " << L << " --cyclotomic " << m
+             << " (" << plan.nslots << " slots, " << plan.chunks << " chunks, estimated " << plan.cost << "s)" << endl;
+        if (!vm.count("generate_key"))
+            return 0;
+    }
+
     if (vm.count("generate_key"))
     {
         cout << "[CLT] Removing all old data" << endl;
-        create_dir(vm["dir_client"].as<string>() + bl::dir_client_pubKey, ".*\\.key");
-        create_dir(vm["dir_client"].as<string>() + bl::dir_client_privKey, ".*\\.key");
-        generateKeys(m, bl::p, r, bl::L, c, w, d, bl::security, vm["dir_client"].as<string>() + bl::dir_client_pubKey, vm["dir_client"].as<string>() + bl::dir_client_privKey);
+        create_dir(vm["dir_client"].as<string>() + bl::dir_client_pubKey, ".*\\.key|.*\\.bin");
+        create_dir(vm["dir_client"].as<string>() + bl::dir_client_privKey, ".*\\.key|.*\\.bin");
+        generateKeys(m, p, r, L, c, w, d, security, vm["dir_client"].as<string>() + bl::dir_client_pubKey, vm["dir_client"].as<string>() + bl::dir_client_privKey);
         cout << "[CLT] Generated new key files, please use --upload_key" << endl;
     }
 
@@ -276,24 +462,14 @@ int main(int argc, char* argv[])
     }
 
     int nslots = 0;
-    map<int, int> comparison;
-
-        fstream contextFile(vm["dir_client"].as<string>() + string(bl::dir_client_pubKey) + "helib_context.key", fstream::in);
-        // Read context from file
-        unsigned long m1, p1, r1;
-        vector<long> gens, ords;
-        readContextBase(contextFile, m1, p1, r1, gens, ords);
-        FHEcontext context(m1, p1, r1, gens, ords);
-        contextFile >> context;
-
-        fstream secretFile(vm["dir_client"].as<string>() + string(bl::dir_client_privKey) + "helib_secret.key", fstream::in);
-        FHESecKey secretKey(context);
-        const FHEPubKey &publicKey = secretKey;
-        secretFile >> secretKey;
-
-        ZZX G = context.alMod.getFactorsOverZZ()[0];
 
-        EncryptedArray ea(context, G);
+        bl::KeyMaterial keys;
+        bl::loadKeys("[CLT]", vm["dir_client"].as<string>() + string(bl::dir_client_pubKey) + "helib_context.key",
+                     vm["dir_client"].as<string>() + string(bl::dir_client_privKey) + "helib_secret.key",
+                     vm["dir_client"].as<string>() + string(bl::dir_client_privKey) + bl::secret_snapshot_file, true, keys);
+        FHESecKey &secretKey = *keys.secretKey;
+        const FHEPubKey &publicKey = secretKey;
+        EncryptedArray &ea = *keys.ea;
 
         nslots = ea.size();
         //cout << "[CLT] Slots: " << nslots << endl;
@@ -305,24 +481,198 @@ int main(int argc, char* argv[])
      *
      */
 
-    if(vm.count("db_bloom"))
+    unique_ptr<bl::BloomBuilder> vcfBuilder;
+    if (vm.count("db_vcf") || vm.count("qry_vcf"))
+        vcfBuilder.reset(new bl::BloomBuilder(vm["vcf_m"].as<long>(), vm["vcf_q"].as<double>(), vm.count("blocked") ? nslots : 0));
+
+    if(vm.count("db_bloom") || vm.count("db_vcf") || vm.count("remove"))
     {
-        create_dir(vm["dir_client"].as<string>() + bl::dir_client_db, ".*\\.enc");
-        vector<string> dbFilenames = bl::enumerateFiles(vm["db_bloom"].as<string>() + '/', "database_.*");
+        string dbDirectory = vm["dir_client"].as<string>() + bl::dir_client_db;
+        // outside the database directory, the VCF paths must never be uploaded to the server
+        string sourcesFilename = vm["dir_client"].as<string>() + bl::vcf_sources_file;
+
+        // incremental updates keep the encrypted patients and the lineage of the current database
+        bool incremental = vm.count("update") || vm.count("replace") || vm.count("remove");
+        bl::ManifestVersion dbVersion = incremental ? bl::readManifestVersion(dbDirectory) : bl::ManifestVersion();
+        if (incremental && (dbVersion.lineage == 0 || vm["layout"].as<string>() == "column" || fs::exists(dbDirectory + bl::column_layout_file)))
+        {
+            cout << "[CLT] Incremental updates need a row layout database encrypted by this version, please run --db_bloom without --update/--replace/--remove first" << endl;
+            return -1;
+        }
+        if (incremental && vm.count("db_vcf") && !fs::exists(sourcesFilename))
+        {
+            cout << "[CLT] Incremental updates with --db_vcf need a database encrypted with --db_vcf by this version, please run --db_vcf without --update/--replace/--remove first" << endl;
+            return -1;
+        }
+        if (!incremental)
+        {
+            create_dir(dbDirectory, ".*\\.enc|manifest\\.txt|column_layout\\.txt");
+            fs::remove(sourcesFilename);
+            dbVersion.lineage = bl::newManifestLineage();
+        }
+        dbVersion.version++;
 
-        #pragma omp parallel for schedule(dynamic,1)
-        for (int j = 0; j < (int) dbFilenames.size(); j++)
+        vector<string> dbFilenames;
+        map<string, string> dbSources;   // patient name -> Bloom file or VCF it is read from
+        vector<bl::ManifestEntry> manifest;
+
+        if (vm.count("db_vcf"))
+        {
+            // same patient names as fhebloom_builder and bloomfiltering_database.py, an incremental update
+            // keeps the name recorded for a VCF file and numbers new VCF files after the existing patients
+            string suffix = "_" + to_string(vm["vcf_m"].as<long>());
+            map<string, string> recorded;   // VCF file name -> patient name
+            for (const auto& source : loadVcfSources(sourcesFilename))
+                if (source.first.size() > suffix.size() && source.first.compare(source.first.size() - suffix.size(), suffix.size(), suffix) == 0)
+                    recorded[fs::path(source.second).filename().string()] = source.first;
+
+            unsigned long next = 0;
+            if (incremental)
+                for (const bl::ManifestEntry& entry : bl::readManifest(dbDirectory))
+                    if (entry.name.compare(0, 9, "database_") == 0)
+                        next = max(next, strtoul(entry.name.c_str() + 9, nullptr, 10) + 1);
+
+            vector<string> vcfList = bl::enumerateVcf(vm["db_vcf"].as<string>(), vm["vcf_pattern"].as<string>());
+            for (const string& vcf : vcfList)
+            {
+                auto name = recorded.find(fs::path(vcf).filename().string());
+                dbFilenames.push_back(name != recorded.end() ? name->second : "database_" + to_string(next++) + suffix);
+                dbSources[dbFilenames.back()] = vcf;
+            }
+        }
+        else if (vm.count("db_bloom"))
         {
-            vector<bool> db;
-            int setBits = loadBloomFile(vm["db_bloom"].as<string>() + '/' + dbFilenames.at(j), db);
-            vector<vector<long>> db_vector;
-            db_vector = splitVector(db, nslots);
-            encryptBloomfilter(ea, publicKey, db_vector, vm["db_bloom"].as<string>() + '/' + dbFilenames.at(j), vm["dir_client"].as<string>() + string(bl::dir_client_db) + dbFilenames.at(j), setBits);
+            dbFilenames = bl::enumerateFiles(vm["db_bloom"].as<string>() + '/', "database_.*");
+            for (const string& dbFilename : dbFilenames)
+                dbSources[dbFilename] = vm["db_bloom"].as<string>() + '/' + dbFilename;
         }
+        const bl::BloomBuilder *dbBuilder = vm.count("db_vcf") ? vcfBuilder.get() : nullptr;
+        unique_ptr<bl::Uploader> dbStream = startStream(vm, bl::dir_server_db, incremental);
 
-        // Encrypt empty vector for chunk aggregation
-        vector<vector<long>> emptyVector(1 , vector<long>(nslots, 0));
-        encryptBloomfilter(ea, publicKey, emptyVector, "", vm["dir_client"].as<string>() + string(bl::dir_client_db) + "emptyvector", 0);
+        if (incremental)
+        {
+            set<string> replaced = splitNames(vm, "replace");
+            set<string> removed = splitNames(vm, "remove");
+
+            // unchanged patients keep their container and version, removed ones are deleted
+            set<string> kept;
+            for (const bl::ManifestEntry& entry : bl::readManifest(dbDirectory))
+            {
+                if (removed.count(entry.name))
+                {
+                    fs::remove(dbDirectory + entry.name + ".enc");
+                    if (dbStream)
+                        dbStream->remove(string(bl::dir_server_db) + entry.name + ".enc");
+                    cout << "[CLT] Removed: " << entry.name << endl;
+                }
+                else if (!replaced.count(entry.name))
+                {
+                    manifest.push_back(entry);
+                    kept.insert(entry.name);
+                }
+            }
+
+            for (const string& name : replaced)
+                if (!dbSources.count(name))
+                    cout << "[CLT] WARNING: " << name << " not found, it cannot be replaced" << endl;
+
+            vector<string> changed;
+            for (const string& dbFilename : dbFilenames)
+                if (!kept.count(dbFilename) && !removed.count(dbFilename) && (vm.count("update") || replaced.count(dbFilename)))
+                    changed.push_back(dbFilename);
+            dbFilenames = changed;
+
+            cout << "[CLT] Database version " << dbVersion.version << ": keeping " << kept.size() << " containers, encrypting " << dbFilenames.size() << endl;
+        }
+
+        if (vm["layout"].as<string>() == "column")
+        {
+            // group patients with the same Bloom filter length, up to nslots patients per group
+            map<string, vector<string>> bloomGroups;
+            for (const string& dbFilename : dbFilenames)
+            {
+                int tmpPos = dbFilename.find("_");
+                bloomGroups[dbFilename.substr(dbFilename.find("_", tmpPos+1)+1)].push_back(dbFilename);
+            }
+
+            fstream layoutFile(vm["dir_client"].as<string>() + bl::dir_client_db + bl::column_layout_file, fstream::out|fstream::trunc);
+            for (const auto& bloomGroup : bloomGroups)
+            {
+                const vector<string>& patients = bloomGroup.second;
+                for (size_t g = 0; g * nslots < patients.size(); g++)
+                {
+                    vector<string> members(patients.begin() + g * nslots, patients.begin() + min(patients.size(), (g+1) * nslots));
+                    vector<vector<bool>> blooms(members.size());
+                    exception_ptr failure;
+
+                    #pragma omp parallel for schedule(dynamic,1)
+                    for (int s = 0; s < (int) members.size(); s++)
+                        if (unique_ptr<bl::BloomFile> bloom = openBloom(dbSources.at(members.at(s)), dbBuilder, failure))
+                            bloom->decode(blooms.at(s));
+                    if (failure)
+                        rethrow_exception(failure);
+
+                    string group = "column_" + to_string(g) + "_" + bloomGroup.first;
+                    manifest.push_back(encryptColumns(ea, publicKey, blooms, vm["dir_client"].as<string>() + string(bl::dir_client_db) + group, vm.count("compress")));
+                    streamFile(dbStream.get(), dbDirectory, bl::dir_server_db, group + ".enc");
+
+                    layoutFile << group;
+                    for (const string& member : members)
+                        layoutFile << " " << member;
+                    layoutFile << endl;
+                }
+            }
+            layoutFile.close();
+            streamFile(dbStream.get(), dbDirectory, bl::dir_server_db, bl::column_layout_file);
+        }
+        else
+        {
+            size_t offset = manifest.size();
+            manifest.resize(offset + dbFilenames.size());
+            bool acrossFiles = !dbFilenames.empty() && parallelAcrossFiles(dbFilenames.size(), chunksPerFile(dbSources.at(dbFilenames.front()), dbBuilder, nslots));
+            exception_ptr failure;
+
+            #pragma omp parallel for schedule(dynamic,1) if(acrossFiles)
+            for (int j = 0; j < (int) dbFilenames.size(); j++)
+            {
+                unique_ptr<bl::BloomFile> db = openBloom(dbSources.at(dbFilenames.at(j)), dbBuilder, failure);
+                if (!db)
+                    continue;
+                manifest.at(offset + j) = encryptBloomfilter(ea, publicKey, *db, dbSources.at(dbFilenames.at(j)), vm["dir_client"].as<string>() + string(bl::dir_client_db) + dbFilenames.at(j), vm.count("compress"));
+                streamFile(dbStream.get(), dbDirectory, bl::dir_server_db, dbFilenames.at(j) + ".enc");
+            }
+            if (failure)
+                rethrow_exception(failure);
+        }
+
+        // Encrypt empty vector for chunk aggregation, an incremental update keeps it
+        if (none_of(manifest.begin(), manifest.end(), [](const bl::ManifestEntry& entry) { return entry.name == "emptyvector"; }))
+        {
+            manifest.push_back(encryptEmptyVector(ea, publicKey, vm["dir_client"].as<string>() + string(bl::dir_client_db) + "emptyvector", vm.count("compress")));
+            streamFile(dbStream.get(), dbDirectory, bl::dir_server_db, "emptyvector.enc");
+        }
+
+        // containers written in this run belong to the new version
+        for (bl::ManifestEntry& entry : manifest)
+            if (entry.version == 0)
+                entry.version = dbVersion.version;
+
+        bl::writeManifest(vm["dir_client"].as<string>() + bl::dir_client_db, manifest, dbVersion);
+        finishStream(dbStream.get(), dbDirectory, bl::dir_server_db);
+
+        // record the VCF of every patient still in the database for later incremental updates
+        if (vm.count("db_vcf") || fs::exists(sourcesFilename))
+        {
+            map<string, string> sources = loadVcfSources(sourcesFilename);
+            if (vm.count("db_vcf"))
+                for (const auto& source : dbSources)
+                    sources[source.first] = source.second;
+
+            fstream sourcesFile(sourcesFilename, fstream::out|fstream::trunc);
+            for (const bl::ManifestEntry& entry : manifest)
+                if (sources.count(entry.name))
+                    sourcesFile << entry.name << " " << sources.at(entry.name) << endl;
+        }
 
     }
 
@@ -332,25 +682,63 @@ int main(int argc, char* argv[])
      *
      */
 
-    if(vm.count("qry_bloom"))
+    if(vm.count("qry_bloom") || vm.count("qry_vcf"))
     {
-        create_dir(vm["dir_client"].as<string>() + bl::dir_client_qry, "query_.*\\.enc");
-        vector<string> qryFilenames = bl::enumerateFiles(vm["qry_bloom"].as<string>() + '/', "query_.*");
+        create_dir(vm["dir_client"].as<string>() + bl::dir_client_qry, "query_.*\\.enc|manifest\\.txt");
+        vector<string> qryFilenames;
+        map<string, string> qrySources;   // query name -> Bloom file or VCF it is read from
 
-        #pragma omp parallel for schedule(dynamic,1)
+        if (vm.count("qry_vcf"))
+        {
+            qryFilenames.push_back("query_" + to_string(vm["vcf_m"].as<long>()));
+            qrySources[qryFilenames.back()] = vm["qry_vcf"].as<string>();
+        }
+        else
+        {
+            qryFilenames = bl::enumerateFiles(vm["qry_bloom"].as<string>() + '/', "query_.*");
+            for (const string& qryFilename : qryFilenames)
+                qrySources[qryFilename] = vm["qry_bloom"].as<string>() + '/' + qryFilename;
+        }
+        const bl::BloomBuilder *qryBuilder = vm.count("qry_vcf") ? vcfBuilder.get() : nullptr;
+        string qryDirectory = vm["dir_client"].as<string>() + bl::dir_client_qry;
+        unique_ptr<bl::Uploader> qryStream = startStream(vm, bl::dir_server_qry);
+        vector<bl::ManifestEntry> manifest(qryFilenames.size());
+
+        if (vm.count("plain_query"))
+            cout << "[CLT] WARNING: Relaxed security - the query is sent unencrypted" << endl;
+
+        bool acrossFiles = !qryFilenames.empty() && parallelAcrossFiles(qryFilenames.size(), chunksPerFile(qrySources.at(qryFilenames.front()), qryBuilder, nslots));
+        exception_ptr failure;
+
+        #pragma omp parallel for schedule(dynamic,1) if(acrossFiles)
         for (int j = 0; j < (int) qryFilenames.size(); j++)
         {
-            vector<bool> query;
-            int setBits = loadBloomFile(vm["qry_bloom"].as<string>() + '/' + qryFilenames.at(j), query);
-            int tmpPos = qryFilenames.at(j).find("_");
-            string queryname = qryFilenames.at(j).substr(qryFilenames.at(j).find("_", tmpPos+1)+1, qryFilenames.at(j).length());
-            int currentBloom = stoi(queryname.substr(string("query_").length(), queryname.length()));
-            comparison.emplace(currentBloom, setBits);
-
-            vector<vector<long>> query_vector;
-            query_vector = splitVector(query, nslots);
-            encryptBloomfilter(ea, publicKey, query_vector, vm["qry_bloom"].as<string>() + '/' + qryFilenames.at(j), vm["dir_client"].as<string>() + string(bl::dir_client_qry) + qryFilenames.at(j), setBits);
+            unique_ptr<bl::BloomFile> queryBloom = openBloom(qrySources.at(qryFilenames.at(j)), qryBuilder, failure);
+            if (!queryBloom)
+                continue;
+            const bl::BloomFile& query = *queryBloom;
+
+            if (vm.count("plain_query"))
+            {
+                #pragma omp critical
+                cout << "[CLT] >> Plaintext query: " << qryFilenames.at(j) << " - " << query.setBits() << endl;
+
+                vector<bool> bits;
+                query.decode(bits);
+                uint64_t bytes = bl::writePlainQuery(vm["dir_client"].as<string>() + string(bl::dir_client_qry) + qryFilenames.at(j) + ".enc", bits);
+                manifest.at(j) = bl::ManifestEntry{qryFilenames.at(j), query.chunkCount(nslots), bytes};
+                streamFile(qryStream.get(), qryDirectory, bl::dir_server_qry, qryFilenames.at(j) + ".enc");
+                continue;
+            }
+
+            manifest.at(j) = encryptBloomfilter(ea, publicKey, query, qrySources.at(qryFilenames.at(j)), vm["dir_client"].as<string>() + string(bl::dir_client_qry) + qryFilenames.at(j), vm.count("compress"));
+            streamFile(qryStream.get(), qryDirectory, bl::dir_server_qry, qryFilenames.at(j) + ".enc");
         }
+        if (failure)
+            rethrow_exception(failure);
+
+        bl::writeManifest(vm["dir_client"].as<string>() + bl::dir_client_qry, manifest);
+        finishStream(qryStream.get(), qryDirectory, bl::dir_server_qry);
     }
 
     if(vm.count("execute"))
@@ -359,16 +747,37 @@ int main(int argc, char* argv[])
          * Step 3: Process all database files with their respective chunks
          *
          */
-        bl::execute("[CLT]", vm["dir_client"].as<string>() + bl::dir_client_db, vm["dir_client"].as<string>() + bl::dir_client_qry, vm["dir_client"].as<string>() + bl::dir_client_res, publicKey, ea);
+        bl::ExecuteOptions options;
+        options.lazyRelinearization = !vm.count("eager_relin");
+        options.packResults = !vm.count("unpacked_results");
+        options.tasksPerPatient = vm["tasks_per_patient"].as<int>();
+        bl::execute("[CLT]", vm["dir_client"].as<string>() + bl::dir_client_db, vm["dir_client"].as<string>() + bl::dir_client_qry, vm["dir_client"].as<string>() + bl::dir_client_res, publicKey, ea, options);
     }
     else
     {
-        if(vm.count("upload_key"))
-            upload_rsync("public key", vm["dir_client"].as<string>() + bl::dir_client_pubKey, vm["dir_server"].as<string>() + bl::dir_server_pubKey, vm["a"].as<string>(), vm["u"].as<string>(), vm["p"].as<int>());
-        if(vm.count("upload_db"))
-            upload_rsync("encrypted database", vm["dir_client"].as<string>() + bl::dir_client_db, vm["dir_server"].as<string>() + bl::dir_server_db, vm["a"].as<string>(), vm["u"].as<string>(), vm["p"].as<int>());
-        if(vm.count("upload_qry"))
-            upload_rsync("encrypted query", vm["dir_client"].as<string>() + bl::dir_client_qry, vm["dir_server"].as<string>() + bl::dir_server_qry, vm["a"].as<string>(), vm["u"].as<string>(), vm["p"].as<int>());
+        if (vm["transport"].as<string>() == "tcp" || vm.count("stream"))
+        {
+            if(vm.count("upload_key"))
+                upload_tcp("public key", vm["dir_client"].as<string>() + bl::dir_client_pubKey, bl::dir_server_pubKey, vm["a"].as<string>(), vm["tcp_port"].as<int>());
+            // directories encrypted with --stream in this run are already on the server
+            if(vm.count("upload_db") && !(vm.count("stream") && (vm.count("db_bloom") || vm.count("db_vcf") || vm.count("remove"))))
+            {
+                cout << "[CLT] Uploading encrypted database to: " << vm["a"].as<string>() << "[" << vm["tcp_port"].as<int>() << "]" << endl;
+                int files = bl::syncDirectory(vm["a"].as<string>(), vm["tcp_port"].as<int>(), vm["dir_client"].as<string>() + bl::dir_client_db, bl::dir_server_db);
+                cout << "[CLT] Uploaded " << files << " changed files" << endl;
+            }
+            if(vm.count("upload_qry") && !(vm.count("stream") && (vm.count("qry_bloom") || vm.count("qry_vcf"))))
+                upload_tcp("encrypted query", vm["dir_client"].as<string>() + bl::dir_client_qry, bl::dir_server_qry, vm["a"].as<string>(), vm["tcp_port"].as<int>());
+        }
+        else
+        {
+            if(vm.count("upload_key"))
+                upload_rsync("public key", vm["dir_client"].as<string>() + bl::dir_client_pubKey, vm["dir_server"].as<string>() + bl::dir_server_pubKey, vm["a"].as<string>(), vm["u"].as<string>(), vm["p"].as<int>());
+            if(vm.count("upload_db"))
+                upload_rsync("encrypted database", vm["dir_client"].as<string>() + bl::dir_client_db, vm["dir_server"].as<string>() + bl::dir_server_db, vm["a"].as<string>(), vm["u"].as<string>(), vm["p"].as<int>());
+            if(vm.count("upload_qry"))
+                upload_rsync("encrypted query", vm["dir_client"].as<string>() + bl::dir_client_qry, vm["dir_server"].as<string>() + bl::dir_server_qry, vm["a"].as<string>(), vm["u"].as<string>(), vm["p"].as<int>());
+        }
     }
 
     /*
@@ -380,32 +789,62 @@ int main(int argc, char* argv[])
     if(vm.count("download"))
     {
         //delete local result
-        create_dir(vm["dir_client"].as<string>() + bl::dir_client_res, "database_.*");
-        download_rsync(vm["dir_client"].as<string>() + bl::dir_client_res, vm["dir_server"].as<string>() + bl::dir_server_res, vm["a"].as<string>(), vm["u"].as<string>(), vm["p"].as<int>());
+        create_dir(vm["dir_client"].as<string>() + bl::dir_client_res, "(database|column)_.*|packed\\..*|manifest\\.txt");
+        if (vm["transport"].as<string>() == "tcp" || vm.count("stream"))
+        {
+            cout << "[CLT] Downloading results from: " << vm["a"].as<string>() << "[" << vm["tcp_port"].as<int>() << "]" << endl;
+            bl::downloadDirectory(vm["a"].as<string>(), vm["tcp_port"].as<int>(), bl::dir_server_res, vm["dir_client"].as<string>() + bl::dir_client_res);
+        }
+        else
+            download_rsync(vm["dir_client"].as<string>() + bl::dir_client_res, vm["dir_server"].as<string>() + bl::dir_server_res, vm["a"].as<string>(), vm["u"].as<string>(), vm["p"].as<int>());
     }
 
     if(vm.count("decrypt") || vm.count("execute"))
     {
         map<string, int> results;
-        vector<string> resFilenames = bl::enumerateFiles(vm["dir_client"].as<string>() + bl::dir_client_res, "database_.*");
+        vector<bl::ManifestEntry> resEntries = bl::readManifest(vm["dir_client"].as<string>() + bl::dir_client_res);
+        map<string, vector<string>> columnLayout = loadColumnLayout(vm["dir_client"].as<string>() + bl::dir_client_db);
+        vector<bl::DatabaseEntry> database = bl::enumerateDatabase(vm["dir_client"].as<string>() + bl::dir_client_db);
 
         #pragma omp parallel for schedule(dynamic,1)
-        for (int j = 0; j < (int) resFilenames.size(); j++)
+        for (int j = 0; j < (int) resEntries.size(); j++)
         {
-            string prefix = resFilenames.at(j).substr(0, resFilenames.at(j).size()-string("_ct_chunk_0.enc").length());
+            string prefix = resEntries.at(j).name;
+            string group = prefix.substr(0, prefix.find("."));
+            string query = prefix.substr(group.length());
+
+            // patient of every slot: packed results and column layout groups carry patient s in slot s,
+            // single results the count of one patient in every slot
+            vector<string> patients(1, group);
+            if (group == "packed")
+                patients = bl::packedPatients(database, bl::queryBloom(query.substr(1)));
+            else if (columnLayout.count(group))
+                patients = columnLayout.at(group);
 
             #pragma omp critical
             cout << "[CLT] >> Decrypting: " << prefix << "_result.enc" << endl;
 
-            Ctxt ctResult = bl::loadCtChunk(0, publicKey, vm["dir_client"].as<string>() + bl::dir_client_res + prefix);
-
-            // Decrypt
-            vector<long> temp;
-            ea.decrypt(ctResult, secretKey, temp);
-
-            #pragma omp critical
-            cout << "[CLT] <<     Result: " << prefix << " - " << temp.at(0) << endl;
+            bl::CtxtContainer resContainer(vm["dir_client"].as<string>() + bl::dir_client_res + prefix + ".enc");
+            for (uint32_t chunk = 0; chunk < resContainer.size(); chunk++)
+            {
+                Ctxt ctResult(publicKey);
+                resContainer.load(chunk, ctResult);
+
+                // Decrypt
+                vector<long> temp;
+                {
+                    bl::StepTimer timer(bl::step_decrypt);
+                    ea.decrypt(ctResult, secretKey, temp);
+                }
+
+                #pragma omp critical
+                for (size_t s = 0; s < static_cast<size_t>(nslots) && chunk * nslots + s < patients.size(); s++)
+                    cout << "[CLT] <<     Result: " << patients.at(chunk * nslots + s) << query << " - " << temp.at(s) << endl;
+            }
         }
     }
+
+    if (vm.count("metrics"))
+        bl::writeMetrics(vm["metrics"].as<string>());
 }
 
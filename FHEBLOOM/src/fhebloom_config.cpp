@@ -20,62 +20,92 @@
 //            along with this program. If not, see <http://www.gnu.org/licenses/>.
 
 #include <EncryptedArray.h>
+#include <omp.h>
+#include <replicate.h>
 #include <boost/filesystem.hpp>
 #include <boost/regex.hpp>
+#include <atomic>
+#include <cmath>
+#include <exception>
+#include <mutex>
+#include "fhebloom_config.h"
+#include "fhebloom_io.h"
+#include "fhebloom_metrics.h"
 
 namespace fs = boost::filesystem;
 
 namespace bloomLib
 {
+    // reusable ciphertexts kept per thread, enough for the loaded chunk and product of nested tasks
+    const static size_t ctxt_pool_size = 4;
+
+    // bits the noise estimate of a trimmed result stays below the decryption bound
+    const static double result_noise_margin = 10;
 
     Ctxt loadCtChunk(uint32_t chunkNo, const FHEPubKey& publicKey, string prefix)
     {
-        stringstream filename;
-        filename << prefix << "_ct_chunk_" << chunkNo << ".enc";
-        fstream ctChunkFile(filename.str(), fstream::in);
+        CtxtContainer container(prefix + ".enc");
         Ctxt ctChunk(publicKey);
-        ctChunkFile >> ctChunk;
-        ctChunkFile.close();
+        container.load(chunkNo, ctChunk);
         return ctChunk;
     }
 
-    void storeCtResult(Ctxt ctChunk, const FHEPubKey& publicKey, string prefix)
+    uint64_t storeCtResult(const Ctxt& ctChunk, const FHEPubKey& publicKey, string prefix, bool compress)
     {
-        stringstream filename;
-        filename << prefix << "_ct_chunk_0.enc";
-        fstream ctChunkFile(filename.str(), fstream::out|fstream::trunc);
-        ctChunkFile << ctChunk;
-        ctChunkFile.close();
+        CtxtContainerWriter container(prefix + ".enc", 1, compress);
+        container.append(ctChunk);
+        return container.close();
     }
 
-    int getChunkCount(string path, string prefix)
+    void loadKeys(string name, string contextFile, string keyFile, string snapshotFile, bool secret, KeyMaterial& keys)
     {
-        int count = 0;
-        const boost::regex my_filter(prefix + "_ct_chunk_.*\\.enc");
-
-        fs::directory_iterator end_itr;
-        for( boost::filesystem::directory_iterator i(path); i != end_itr; ++i )
+        // the binary snapshot is used unless the text key is newer, e.g. after --generate_key
+        if (fs::exists(snapshotFile) && !(fs::exists(keyFile) && fs::last_write_time(keyFile) > fs::last_write_time(snapshotFile)))
         {
-            // Skip if not a file
-            if( !fs::is_regular_file( i->status() ) )
-                continue;
+            if (readKeySnapshot(snapshotFile, keys, secret))
+                return;
+            cout << name << " Ignoring unsupported key snapshot " << snapshotFile << endl;
+        }
 
-            // skip if no match
-            boost::smatch what;
-            if( !boost::regex_match( i->path().filename().string(), what, my_filter ) )
-                continue;
+        fstream contextStream(contextFile, fstream::in);
+        // Read context from file
+        unsigned long m1, p1, r1;
+        vector<long> gens, ords;
+        readContextBase(contextStream, m1, p1, r1, gens, ords);
+        keys.context.reset(new FHEcontext(m1, p1, r1, gens, ords));
+        contextStream >> *keys.context;
 
-            // File matches, count it
-            count++;
+        fstream keyStream(keyFile, fstream::in);
+        if (secret)
+        {
+            keys.secretKey.reset(new FHESecKey(*keys.context));
+            keyStream >> *keys.secretKey;
+        }
+        else
+        {
+            keys.publicKey.reset(new FHEPubKey(*keys.context));
+            keyStream >> *keys.publicKey;
         }
 
-        return count;
+        keys.G = keys.context->alMod.getFactorsOverZZ()[0];
+        keys.ea.reset(new EncryptedArray(*keys.context, keys.G));
+
+        // the next start only maps the snapshot
+        try
+        {
+            writeKeySnapshot(snapshotFile, *keys.context, keys.G, keys.pubKey(), secret);
+            cout << name << " Wrote key snapshot " << snapshotFile << endl;
+        }
+        catch (const exception& e)
+        {
+            cout << name << " " << e.what() << endl;
+        }
     }
 
     vector<string> enumerateFiles(string path, string filter)
     {
-        // db-filter: "database_.*_ct_chunk_0\.enc"
-        // query-filter: "query.*_ct_chunk_0\.enc"
+        // db-filter: "database_.*"
+        // query-filter: "query_.*"
         vector<string> filenames;
         const boost::regex my_filter(filter);
 
@@ -101,60 +131,801 @@ namespace bloomLib
         return filenames;
     }
 
-    void execute(string name, string database_path, string query_path, string path_result, const FHEPubKey& publicKey, EncryptedArray ea)
+    // Mod-switch to the lowest level that still leaves room for the match multiplication
+    void modDownToBaseLevel(Ctxt& ctxt)
     {
-        if(fs::exists(path_result))
-            fs::remove_all(path_result);
-        fs::create_directory(path_result);
-        
-        if (!fs::exists(database_path) || !fs::exists(query_path))
+        ctxt.modDownToLevel(ctxt.findBaseLevel());
+    }
+
+    uint32_t multiplicationLevel(const FHEPubKey& publicKey)
+    {
+        Ctxt ctxt(publicKey);
+        publicKey.Encrypt(ctxt, ZZX());
+        modDownToBaseLevel(ctxt);
+        return static_cast<uint32_t>(ctxt.getPrimeSet().card());
+    }
+
+    // Records the noise budget of a finished result and mod-switches it to the fewest primes on which
+    // the noise estimate stays result_noise_margin bits below the decryption bound, fewer primes are fewer bytes
+    static void finishResult(Ctxt& ctxt, const ExecuteOptions& options)
+    {
+        recordNoiseBudget(ctxt);
+        if (!options.trimResults)
+            return;
+
+        // log_of_ratio is the natural log of noise over modulus, decryption needs less than 1/2
+        double bound = -log(2.0) * (1 + result_noise_margin);
+        long level = ctxt.findBaseLevel();
+        ctxt.modDownToLevel(level);
+        for (level--; level > 0; level--)
+        {
+            Ctxt ctLower = ctxt;
+            ctLower.modDownToLevel(level);
+            if (ctLower.log_of_ratio() > bound)
+                break;
+            ctxt = ctLower;
+        }
+    }
+
+    static void timedAdd(Ctxt& ctSum, const Ctxt& ctSummand)
+    {
+        StepTimer timer(step_add);
+        ctSum += ctSummand;
+    }
+
+    // Product of two ciphertexts, raw in lazy mode
+    static void timedMultiply(Ctxt& ctProduct, const Ctxt& ctFactor, const ExecuteOptions& options)
+    {
+        StepTimer timer(step_multiply);
+        if (options.lazyRelinearization)
+            ctProduct.multLowLvl(ctFactor);
+        else
+            ctProduct *= ctFactor;
+    }
+
+    // Upper bound of the memory of one ciphertext: a raw product has three parts over all primes
+    static size_t ctxtMemory(const FHEcontext& context)
+    {
+        return 3 * static_cast<size_t>(context.ctxtPrimes.card() + context.specialPrimes.card()) * context.zMStar.getPhiM() * sizeof(long);
+    }
+
+    // Ciphertexts a thread reuses for loaded chunks and products, so the hot loops
+    // do not allocate and free the DoubleCRT storage of every chunk
+    class CtxtPool
+    {
+    public:
+        static CtxtPool& local()
         {
+            thread_local CtxtPool pool;
+            return pool;
+        }
+
+        unique_ptr<Ctxt> acquire(const FHEPubKey& publicKey)
+        {
+            // ciphertexts can only be assigned from ciphertexts under the same key
+            if (key != &publicKey)
+            {
+                available.clear();
+                key = &publicKey;
+            }
+            if (available.empty())
+                return unique_ptr<Ctxt>(new Ctxt(publicKey));
+
+            unique_ptr<Ctxt> ctxt = move(available.back());
+            available.pop_back();
+            return ctxt;
+        }
+
+        void release(unique_ptr<Ctxt> ctxt)
+        {
+            if (available.size() < ctxt_pool_size && &ctxt->getPubKey() == key)
+                available.push_back(move(ctxt));
+        }
+
+    private:
+        const FHEPubKey *key = nullptr;
+        vector<unique_ptr<Ctxt>> available;
+    };
+
+    // Ciphertext of the calling thread's pool, returned at the end of its scope
+    class PooledCtxt
+    {
+    public:
+        explicit PooledCtxt(const FHEPubKey& publicKey) : ctxt(CtxtPool::local().acquire(publicKey)) {}
+        ~PooledCtxt() { CtxtPool::local().release(move(ctxt)); }
+        PooledCtxt(const PooledCtxt&) = delete;
+        PooledCtxt& operator=(const PooledCtxt&) = delete;
+
+        Ctxt& operator*() { return *ctxt; }
+        const Ctxt& operator*() const { return *ctxt; }
+
+    private:
+        unique_ptr<Ctxt> ctxt;
+    };
+
+    // Exceptions must not leave an OpenMP region or task, the first one is kept and rethrown once the region is done
+    class FirstException
+    {
+    public:
+        void capture()
+        {
+            lock_guard<mutex> lock(guard);
+            if (!first)
+                first = current_exception();
+            failed = true;
+        }
+
+        bool caught() const { return failed; }
+
+        void rethrow() const
+        {
+            if (first)
+                rethrow_exception(first);
+        }
+
+    private:
+        mutex guard;
+        exception_ptr first;
+        atomic<bool> failed{false};
+    };
+
+    // Bytes of ciphertexts the tasks of execute may hold at once. A reservation fails while others would
+    // exceed the limit, one that does not fit at all is still granted once nothing else is reserved.
+    class MemoryBudget
+    {
+    public:
+        explicit MemoryBudget(size_t budgetLimit) : limit(budgetLimit) {}
+
+        bool limited() const { return limit > 0; }
+        size_t size() const { return limit; }
+
+        bool reserve(size_t bytes)
+        {
+            lock_guard<mutex> lock(budgetMutex);
+            if (limit > 0 && used > 0 && used + bytes > limit)
+                return false;
+            used += bytes;
+            return true;
+        }
+
+        void release(size_t bytes)
+        {
+            lock_guard<mutex> lock(budgetMutex);
+            used -= bytes;
+        }
+
+    private:
+        mutex budgetMutex;
+        size_t limit;
+        size_t used = 0;
+    };
+
+    vector<DatabaseEntry> enumerateDatabase(string database_path)
+    {
+        vector<DatabaseEntry> database;
+
+        for (const ManifestEntry& manifestEntry : readManifest(database_path))
+        {
+            bool columnLayout = manifestEntry.name.compare(0, string("column_").length(), "column_") == 0;
+            if (manifestEntry.name.compare(0, string("database_").length(), "database_") != 0 && !columnLayout)
+                continue;
+
+            DatabaseEntry entry;
+            entry.prefix = manifestEntry.name;
+            entry.columnLayout = columnLayout;
+            int tmpPos = entry.prefix.find("_");
+            entry.currentBloom = entry.prefix.substr(entry.prefix.find("_", tmpPos+1)+1, entry.prefix.length());
+            entry.numberChunks = static_cast<int>(manifestEntry.numberChunks);
+            database.push_back(entry);
+        }
+
+        return database;
+    }
+
+    void loadDatabase(string name, string database_path, const FHEPubKey& publicKey, vector<DatabaseEntry>& database, const ExecuteOptions& options)
+    {
+        database = enumerateDatabase(database_path);
+
+        // with a memory limit at most half of it is resident, the remaining patients are read from disk in execute
+        int resident = (int) database.size();
+        if (options.memoryLimit > 0)
+        {
+            size_t bytes = 0, perChunk = ctxtMemory(publicKey.getContext());
+            for (resident = 0; resident < (int) database.size(); resident++)
+            {
+                bytes += database.at(resident).numberChunks * perChunk;
+                if (bytes > options.memoryLimit / 2)
+                    break;
+            }
+        }
+
+        FirstException failure;
+        #pragma omp parallel for schedule(dynamic,1)
+        for (int j = 0; j < resident; j++)
+        {
+            if (failure.caught())
+                continue;
+            try
+            {
+                DatabaseEntry& entry = database.at(j);
+                CtxtContainer dbContainer(database_path + entry.prefix + ".enc", options.minimumLevel);
+                entry.chunks.assign(entry.numberChunks, Ctxt(publicKey));
+                for (int i = 0; i < entry.numberChunks; i++)
+                {
+                    dbContainer.load(static_cast<uint32_t>(i), entry.chunks.at(i));
+                    if (options.lazyRelinearization)
+                        modDownToBaseLevel(entry.chunks.at(i));
+                }
+            }
+            catch (...)
+            {
+                failure.capture();
+            }
+        }
+        failure.rethrow();
+
+        cout << name << " Loaded " << resident << " of " << database.size() << " database files into memory" << endl;
+    }
+
+    void execute(string name, string database_path, string query_path, string path_result, const FHEPubKey& publicKey, const EncryptedArray& ea, const ExecuteOptions& options)
+    {
+        if (!fs::exists(database_path + manifest_file) || !fs::exists(query_path + manifest_file))
+        {
+            if(fs::exists(path_result))
+                fs::remove_all(path_result);
+            fs::create_directory(path_result);
+
             cout << name << " >> No files to calculate" << endl;
             return;
         }
         
         Ctxt ctEmpty = loadCtChunk(0, publicKey, database_path + "emptyvector");
-        vector<string> dbFilenames = enumerateFiles(database_path, "database_.*_ct_chunk_0\\.enc");
+        vector<DatabaseEntry> database = enumerateDatabase(database_path);
+
+        execute(name, database_path, database, ctEmpty, query_path, path_result, publicKey, ea, options);
+    }
+
+    string queryBloom(string queryName)
+    {
+        // query_<m> or query_<m>_<tag>, a query matches all patients with the same m
+        string suffix = queryName.substr(string("query_").length());
+        return suffix.substr(0, suffix.find("_"));
+    }
+
+    vector<string> packedPatients(const vector<DatabaseEntry>& database, string currentBloom)
+    {
+        // packed results hold the i-th of these patients in slot i % nslots of chunk i / nslots
+        vector<string> patients;
+        for (const DatabaseEntry& entry : database)
+            if (!entry.columnLayout && entry.currentBloom == currentBloom)
+                patients.push_back(entry.prefix);
+        return patients;
+    }
+
+    vector<QueryEntry> loadQueries(string query_path, const FHEPubKey& publicKey, const EncryptedArray& ea, const ExecuteOptions& options)
+    {
+        vector<QueryEntry> queries;
+
+        for (const ManifestEntry& manifestEntry : readManifest(query_path))
+        {
+            QueryEntry query;
+            query.name = manifestEntry.name;
+            query.currentBloom = queryBloom(query.name);
+            query.plaintext = isPlainQuery(query_path + query.name + ".enc");
+            if (!query.plaintext)
+                query.chunks.assign(manifestEntry.numberChunks, Ctxt(publicKey));
+            queries.push_back(query);
+        }
 
-        // process all database entries
+        FirstException failure;
         #pragma omp parallel for schedule(dynamic,1)
-        for (int j = 0; j < (int) dbFilenames.size(); j++)
+        for (int k = 0; k < (int) queries.size(); k++)
+        {
+            if (failure.caught())
+                continue;
+            try
+            {
+                QueryEntry& query = queries.at(k);
+                if (query.plaintext)
+                {
+                    // encode every chunk with set bits once, chunks without set bits stay empty and are skipped
+                    readPlainQuery(query_path + query.name + ".enc", query.bits);
+                    long nslots = ea.size();
+                    query.encodedChunks.resize((query.bits.size() + nslots - 1) / nslots);
+                    for (size_t i = 0; i < query.encodedChunks.size(); i++)
+                    {
+                        vector<long> slots(nslots, 0);
+                        bool active = false;
+                        for (long s = 0; s < nslots && i * nslots + s < query.bits.size(); s++)
+                        {
+                            slots.at(s) = query.bits.at(i * nslots + s);
+                            active |= query.bits.at(i * nslots + s);
+                        }
+                        if (!active)
+                            continue;
+
+                        ZZX poly;
+                        ea.encode(poly, slots);
+                        query.encodedChunks.at(i) = make_shared<DoubleCRT>(poly, publicKey.getContext());
+                    }
+                    continue;
+                }
+
+                CtxtContainer queryContainer(query_path + query.name + ".enc", options.minimumLevel);
+                for (uint32_t i = 0; i < query.chunks.size(); i++)
+                {
+                    queryContainer.load(i, query.chunks.at(i));
+                    if (options.lazyRelinearization)
+                        modDownToBaseLevel(query.chunks.at(i));
+                }
+            }
+            catch (...)
+            {
+                failure.capture();
+            }
+        }
+        failure.rethrow();
+
+        return queries;
+    }
+
+    // Queries a patient (or patient group) is matched against, all with the same Bloom filter length
+    static vector<const QueryEntry *> queryBatch(const vector<QueryEntry>& queries, const DatabaseEntry& entry)
+    {
+        vector<const QueryEntry *> batch;
+        for (const QueryEntry& query : queries)
+            if (query.currentBloom == entry.currentBloom)
+                batch.push_back(&query);
+        return batch;
+    }
+
+    // Receives the replicas of one query chunk from replicateAll in slot order and
+    // multiplies each with the database column of the corresponding Bloom position
+    class ColumnAccumulator : public ReplicateHandler
+    {
+    public:
+        ColumnAccumulator(const DatabaseEntry& columnEntry, const CtxtContainer *columnContainer, long firstPosition, const Ctxt& ctEmpty, const ExecuteOptions& executeOptions)
+            : ctSum(ctEmpty), entry(columnEntry), dbContainer(columnContainer), position(firstPosition), options(executeOptions),
+              ctProduct(ctEmpty.getPubKey()), ctDbColumn(ctEmpty.getPubKey())
+        {
+            if (dbContainer && options.readaheadChunks > 0)
+                dbContainer->readahead(static_cast<uint32_t>(position), static_cast<uint32_t>(position + options.readaheadChunks));
+        }
+
+        void handle(const Ctxt& ctReplica) override
+        {
+            long current = position++;
+            if (current >= entry.numberChunks)
+                return;
+
+            auto start = chrono::steady_clock::now();
+
+            *ctProduct = ctReplica;
+            if (dbContainer)
+            {
+                if (options.readaheadChunks > 0)
+                    dbContainer->readahead(static_cast<uint32_t>(current + options.readaheadChunks), static_cast<uint32_t>(current + options.readaheadChunks + 1));
+                dbContainer->load(static_cast<uint32_t>(current), *ctDbColumn);
+                if (options.lazyRelinearization)
+                    modDownToBaseLevel(*ctDbColumn);
+            }
+            const Ctxt& ctColumn = dbContainer ? *ctDbColumn : entry.chunks.at(current);
+
+            timedMultiply(*ctProduct, ctColumn, options);
+            timedAdd(ctSum, *ctProduct);
+            handled += chrono::steady_clock::now() - start;
+        }
+
+        Ctxt ctSum;
+        chrono::steady_clock::duration handled = chrono::steady_clock::duration::zero();  // time spent in handle, not in replicateAll
+
+    private:
+        const DatabaseEntry& entry;
+        const CtxtContainer *dbContainer;
+        long position;
+        const ExecuteOptions& options;
+        PooledCtxt ctProduct;
+        PooledCtxt ctDbColumn;
+    };
+
+    // Relinearize an accumulated sum of raw products once and drop it to its lowest level
+    static void finishAccumulation(Ctxt& ctxt, const ExecuteOptions& options)
+    {
+        if (!options.lazyRelinearization)
+            return;
+        StepTimer timer(step_relinearize);
+        ctxt.reLinearize();
+        modDownToBaseLevel(ctxt);
+    }
+
+    // Adds the products of chunks [first, last) of a row layout patient with every query of the batch to ctResults
+    static void accumulateChunks(const DatabaseEntry& entry, const CtxtContainer *dbContainer, const vector<const QueryEntry *>& batch, int first, int last, vector<Ctxt>& ctResults, const FHEPubKey& publicKey, const ExecuteOptions& options)
+    {
+        PooledCtxt ctLoadedChunk(publicKey);
+        PooledCtxt ctProduct(publicKey);
+
+        // chunks in which no query of the batch has a set bit are skipped entirely
+        vector<int> needed;
+        for (int i = first; i < last && !batch.empty(); i++)
+        {
+            bool chunkNeeded = false;
+            for (const QueryEntry *query : batch)
+                chunkNeeded |= !query->plaintext || query->encodedChunks.at(i);
+            if (chunkNeeded)
+                needed.push_back(i);
+        }
+
+        // the pages of the next readaheadChunks needed chunks are read from disk while the current one is multiplied
+        if (dbContainer)
+            for (int n = 0; n < options.readaheadChunks && n < (int) needed.size(); n++)
+                dbContainer->readahead(static_cast<uint32_t>(needed.at(n)), static_cast<uint32_t>(needed.at(n) + 1));
+
+        // every database chunk is loaded once for the whole batch
+        for (int n = 0; n < (int) needed.size(); n++)
+        {
+            int i = needed.at(n);
+
+            // Load Database chunk, either resident or from disk
+            if (dbContainer)
+            {
+                if (options.readaheadChunks > 0 && n + options.readaheadChunks < (int) needed.size())
+                    dbContainer->readahead(static_cast<uint32_t>(needed.at(n + options.readaheadChunks)), static_cast<uint32_t>(needed.at(n + options.readaheadChunks) + 1));
+                dbContainer->load(static_cast<uint32_t>(i), *ctLoadedChunk);
+                if (options.lazyRelinearization)
+                    modDownToBaseLevel(*ctLoadedChunk);
+            }
+            const Ctxt& ctDbChunk = dbContainer ? *ctLoadedChunk : entry.chunks.at(i);
+
+            for (size_t k = 0; k < batch.size(); k++)
+            {
+                const QueryEntry& query = *batch.at(k);
+
+                // plaintext query: multiply with the precomputed encoding, no key switching required
+                if (query.plaintext)
+                {
+                    if (!query.encodedChunks.at(i))
+                        continue;
+                    *ctProduct = ctDbChunk;
+                    {
+                        StepTimer timer(step_multiply);
+                        (*ctProduct).multByConstant(*query.encodedChunks.at(i));
+                    }
+                    timedAdd(ctResults.at(k), *ctProduct);
+                    continue;
+                }
+
+                // Perform Calculation under encryption, in lazy mode the product is not relinearized yet
+                *ctProduct = query.chunks.at(i);
+                timedMultiply(*ctProduct, ctDbChunk, options);
+
+                // Aggregate Result per file and query
+                timedAdd(ctResults.at(k), *ctProduct);
+            }
+        }
+    }
+
+    void execute(string name, string database_path, const vector<DatabaseEntry>& database, const Ctxt& ctEmpty, string query_path, string path_result, const FHEPubKey& publicKey, const EncryptedArray& ea, const ExecuteOptions& options)
+    {
+        if(fs::exists(path_result))
+            fs::remove_all(path_result);
+        fs::create_directory(path_result);
+
+        // all queries are loaded once and shared read-only between the threads
+        const vector<QueryEntry> queries = loadQueries(query_path, publicKey, ea, options);
+
+        // with blocked Bloom filters a plaintext query only touches one chunk per SNP
+        for (const QueryEntry& query : queries)
+            if (query.plaintext)
+                cout << name << " Plaintext query " << query.name << " touches " << count_if(query.encodedChunks.begin(), query.encodedChunks.end(), [](const shared_ptr<DoubleCRT>& chunk) { return chunk != nullptr; })
+                     << " of " << query.encodedChunks.size() << " chunks" << endl;
+
+        vector<vector<ManifestEntry>> results(database.size());
+
+        // slot position of every row layout patient in the packed results, same order as packedPatients
+        vector<long> rowPosition(database.size(), -1);
+        map<string, long> rowCount;
+        for (size_t j = 0; j < database.size(); j++)
+            if (!database.at(j).columnLayout)
+                rowPosition.at(j) = rowCount[database.at(j).currentBloom]++;
+
+        map<string, vector<Ctxt>> packed;
+        if (options.packResults)
+            for (const QueryEntry& query : queries)
+                if (rowCount.count(query.currentBloom))
+                    packed.emplace(query.name, vector<Ctxt>((rowCount.at(query.currentBloom) + ea.size() - 1) / ea.size(), ctEmpty));
+
+        // resident database, queries and packed results are held for the whole run, the rest of the limit is for the tasks
+        size_t perCtxt = ctxtMemory(publicKey.getContext());
+        size_t resident = 0;
+        for (const DatabaseEntry& entry : database)
+            resident += entry.chunks.size();
+        for (const QueryEntry& query : queries)
+            resident += query.chunks.size();
+        for (const auto& packedQuery : packed)
+            resident += packedQuery.second.size();
+        if (options.memoryLimit > 0 && resident * perCtxt >= options.memoryLimit)
+            cout << name << " WARNING: " << resident << " resident ciphertexts exceed the memory limit, processing one patient at a time" << endl;
+        MemoryBudget budget(options.memoryLimit > 0 ? max(perCtxt, options.memoryLimit - min(options.memoryLimit, resident * perCtxt)) : 0);
+
+        // process all database entries in row layout, one patient per ciphertext,
+        // each patient is split into tasks over consecutive chunks so idle threads pick up work of long Bloom filters
+        int tasksPerPatient = options.tasksPerPatient > 0 ? options.tasksPerPatient : 2 * omp_get_max_threads();
+
+        // a failed patient stops the remaining ones, its exception is rethrown after the region
+        FirstException failure;
+
+        #pragma omp parallel
+        #pragma omp single
+        for (int j = 0; j < (int) database.size(); j++)
         {
-            Ctxt ctResult = ctEmpty;
+            if (database.at(j).columnLayout || failure.caught())
+                continue;
 
-            // for each chunk perform calculation
-            string prefix = dbFilenames.at(j).substr(0, dbFilenames.at(j).size()-string("_ct_chunk_0.enc").length());
-            int tmpPos = prefix.find("_");
-            string currentBloom = prefix.substr(prefix.find("_", tmpPos+1)+1, prefix.length());
-            int numberChunks = getChunkCount(database_path, prefix);
+            // the batch of queries this patient is matched against
+            vector<const QueryEntry *> batch = queryBatch(queries, database.at(j));
 
-            #pragma omp critical
-            cout << name << " >> Calculating: " << prefix << ".enc" << endl;
+            // one partial sum per task and query plus the loaded chunk and product of every running task,
+            // under a memory limit fewer tasks per patient keep more patients in flight
+            int tasks = max(1, min(database.at(j).numberChunks, tasksPerPatient));
+            if (budget.limited())
+                tasks = max(1, min(tasks, static_cast<int>(budget.size() / (perCtxt * (batch.size() + 2)))));
+            size_t bytes = perCtxt * (tasks * batch.size() + 2 * min(tasks, omp_get_num_threads()));
+
+            // throttle: wait for the patients in flight before exceeding the limit
+            if (!budget.reserve(bytes))
+            {
+                #pragma omp taskwait
+                budget.reserve(bytes);
+            }
 
-            for (int i = 0; i < numberChunks; i++)
+            #pragma omp task default(shared) firstprivate(j, batch, tasks, bytes)
             {
-                // Load Database chunk
-                Ctxt ctDbChunk = loadCtChunk(static_cast<uint32_t>(i), publicKey, database_path + prefix);
+                if (!failure.caught())
+                {
+                    try
+                    {
+                        const DatabaseEntry& entry = database.at(j);
+
+                        #pragma omp critical
+                        cout << name << " >> Calculating: " << entry.prefix << ".enc against " << batch.size() << " queries" << endl;
+
+                        // the database container is only opened if the chunks are not resident
+                        unique_ptr<CtxtContainer> dbContainer;
+                        if (entry.chunks.empty() && !batch.empty())
+                            dbContainer.reset(new CtxtContainer(database_path + entry.prefix + ".enc", options.minimumLevel));
+
+                        // partial sums are only allocated once their task runs
+                        vector<vector<Ctxt>> partials(tasks);
+
+                        #pragma omp taskloop default(shared) grainsize(1)
+                        for (int t = 0; t < tasks; t++)
+                        {
+                            try
+                            {
+                                partials.at(t).assign(batch.size(), ctEmpty);
+                                accumulateChunks(entry, dbContainer.get(), batch, t * entry.numberChunks / tasks, (t+1) * entry.numberChunks / tasks, partials.at(t), publicKey, options);
+                            }
+                            catch (...)
+                            {
+                                failure.capture();
+                            }
+                        }
+                        failure.rethrow();
+
+                        // tree reduction, every round adds independent pairs of partial sums in parallel
+                        for (int stride = 1; stride < tasks; stride *= 2)
+                        {
+                            #pragma omp taskloop default(shared) grainsize(1)
+                            for (int t = 0; t < tasks - stride; t += 2 * stride)
+                            {
+                                try
+                                {
+                                    for (size_t k = 0; k < batch.size(); k++)
+                                        timedAdd(partials.at(t).at(k), partials.at(t + stride).at(k));
+                                    partials.at(t + stride).clear();
+                                }
+                                catch (...)
+                                {
+                                    failure.capture();
+                                }
+                            }
+                            failure.rethrow();
+                        }
+                        vector<Ctxt>& ctResults = partials.at(0);
+
+                        for (size_t k = 0; k < batch.size(); k++)
+                        {
+                            finishAccumulation(ctResults.at(k), options);
+                            {
+                                StepTimer timer(step_total_sums);
+                                totalSums(ea, ctResults.at(k));
+                            }
+
+                            if (options.packResults)
+                            {
+                                // all slots hold the count now, mask out everything but the patient's slot and add it to its group
+                                long position = rowPosition.at(j);
+                                ZZX mask;
+                                ea.encodeUnitSelector(mask, position % ea.size());
+                                {
+                                    StepTimer timer(step_multiply);
+                                    ctResults.at(k).multByConstant(mask);
+                                }
+
+                                // an exception must not leave the critical section
+                                #pragma omp critical(packing)
+                                {
+                                    try
+                                    {
+                                        timedAdd(packed.at(batch.at(k)->name).at(position / ea.size()), ctResults.at(k));
+                                    }
+                                    catch (...)
+                                    {
+                                        failure.capture();
+                                    }
+                                }
+                                continue;
+                            }
+
+                            // Store result encrypted in directory
+                            string resultName = entry.prefix + "." + batch.at(k)->name;
+                            finishResult(ctResults.at(k), options);
+                            results.at(j).push_back(ManifestEntry{resultName, 1, storeCtResult(ctResults.at(k), publicKey, path_result + resultName, options.compressResults)});
+                        }
+
+                        #pragma omp critical
+                        cout << name << " <<    Finished: " << entry.prefix << "_result.enc" << endl;
+                    }
+                    catch (...)
+                    {
+                        failure.capture();
+                    }
+                }
+
+                budget.release(bytes);
+            }
+        }
+        failure.rethrow();
+
+        // column layout threads each hold a partial sum, a loaded column, a product and the replicas of replicateAll
+        int columnThreads = omp_get_max_threads();
+        if (budget.limited())
+            columnThreads = max(1, min(columnThreads, static_cast<int>(budget.size() / (perCtxt * (3 + static_cast<size_t>(ceil(log2(ea.size()))))))));
+
+        // process all patient groups in column layout, slot s of chunk b holds Bloom bit b of patient s,
+        // the result slots directly carry the match count of every patient so no totalSums is needed
+        for (int j = 0; j < (int) database.size(); j++)
+        {
+            const DatabaseEntry& entry = database.at(j);
+            if (!entry.columnLayout)
+                continue;
 
-                // Load Query chunk
-                Ctxt ctQueryChunk = loadCtChunk(static_cast<uint32_t>(i), publicKey, query_path + "query_" + currentBloom);
+            vector<const QueryEntry *> batch = queryBatch(queries, entry);
 
-                // Perform Calculation under encryption
-                ctDbChunk *= ctQueryChunk;
+            cout << name << " >> Calculating: " << entry.prefix << ".enc against " << batch.size() << " queries" << endl;
 
-                // Aggregate Result per file
-                ctResult += ctDbChunk;
+            unique_ptr<CtxtContainer> dbContainer;
+            if (entry.chunks.empty() && !batch.empty())
+                dbContainer.reset(new CtxtContainer(database_path + entry.prefix + ".enc", options.minimumLevel));
 
+            for (const QueryEntry *query : batch)
+            {
+                Ctxt ctResult = ctEmpty;
+
+                if (query->plaintext)
+                {
+                    // plaintext query: select and add the columns of all set query bits, no multiplication at all
+                    vector<int> positions;
+                    for (int b = 0; b < entry.numberChunks && b < (int) query->bits.size(); b++)
+                        if (query->bits.at(b))
+                            positions.push_back(b);
+
+                    #pragma omp parallel num_threads(columnThreads)
+                    {
+                        Ctxt ctPartial = ctEmpty;
+                        Ctxt ctLoadedColumn(publicKey);
+
+                        #pragma omp for schedule(dynamic,16)
+                        for (int b = 0; b < (int) positions.size(); b++)
+                        {
+                            if (failure.caught())
+                                continue;
+                            try
+                            {
+                                if (dbContainer)
+                                {
+                                    if (options.readaheadChunks > 0 && b + options.readaheadChunks < (int) positions.size())
+                                        dbContainer->readahead(static_cast<uint32_t>(positions.at(b + options.readaheadChunks)), static_cast<uint32_t>(positions.at(b + options.readaheadChunks) + 1));
+                                    dbContainer->load(static_cast<uint32_t>(positions.at(b)), ctLoadedColumn);
+                                    timedAdd(ctPartial, ctLoadedColumn);
+                                }
+                                else
+                                    timedAdd(ctPartial, entry.chunks.at(positions.at(b)));
+                            }
+                            catch (...)
+                            {
+                                failure.capture();
+                            }
+                        }
+
+                        // an exception must not leave the critical section
+                        #pragma omp critical
+                        {
+                            try
+                            {
+                                timedAdd(ctResult, ctPartial);
+                            }
+                            catch (...)
+                            {
+                                failure.capture();
+                            }
+                        }
+                    }
+                    failure.rethrow();
+                }
+                else
+                {
+                    // every query chunk covers nslots Bloom positions, its replicas select the matching columns
+                    #pragma omp parallel for schedule(dynamic,1) num_threads(columnThreads)
+                    for (int c = 0; c < (int) query->chunks.size(); c++)
+                    {
+                        if (failure.caught())
+                            continue;
+                        try
+                        {
+                            ColumnAccumulator accumulator(entry, dbContainer.get(), c * ea.size(), ctEmpty, options);
+                            auto start = chrono::steady_clock::now();
+                            replicateAll(ea, query->chunks.at(c), &accumulator);
+                            recordStep(step_total_sums, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start - accumulator.handled).count());
+
+                            #pragma omp critical
+                            {
+                                try
+                                {
+                                    timedAdd(ctResult, accumulator.ctSum);
+                                }
+                                catch (...)
+                                {
+                                    failure.capture();
+                                }
+                            }
+                        }
+                        catch (...)
+                        {
+                            failure.capture();
+                        }
+                    }
+                    failure.rethrow();
+                    finishAccumulation(ctResult, options);
+                }
+
+                // Store result encrypted in directory
+                string resultName = entry.prefix + "." + query->name;
+                finishResult(ctResult, options);
+                results.at(j).push_back(ManifestEntry{resultName, 1, storeCtResult(ctResult, publicKey, path_result + resultName, options.compressResults)});
             }
-            totalSums(ea, ctResult);
 
-            // Store result encrypted in directory
-            storeCtResult(ctResult, publicKey, path_result + prefix);
+            cout << name << " <<    Finished: " << entry.prefix << "_result.enc" << endl;
+        }
 
-            #pragma omp critical
-            cout << name << " <<    Finished: " << prefix << "_result.enc" << endl;
+        vector<ManifestEntry> manifest;
+        for (const vector<ManifestEntry>& patientResults : results)
+            manifest.insert(manifest.end(), patientResults.begin(), patientResults.end());
 
+        // one container per query holds the counts of all row layout patients
+        for (auto& packedQuery : packed)
+        {
+            string resultName = "packed." + packedQuery.first;
+            CtxtContainerWriter container(path_result + resultName + ".enc", static_cast<uint32_t>(packedQuery.second.size()), options.compressResults);
+            for (Ctxt& ctPacked : packedQuery.second)
+            {
+                finishResult(ctPacked, options);
+                container.append(ctPacked);
+            }
+            manifest.push_back(ManifestEntry{resultName, static_cast<uint32_t>(packedQuery.second.size()), container.close()});
         }
+
+        writeManifest(path_result, manifest);
     }
 
     void removeFiles(string path, string filter)
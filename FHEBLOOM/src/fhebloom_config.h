@@ -19,7 +19,12 @@
 //            You should have received a copy of the GNU Affero General Public License
 //            along with this program. If not, see <http://www.gnu.org/licenses/>.
 
+#ifndef FHEBLOOM_CONFIG_H
+#define FHEBLOOM_CONFIG_H
+
 #include <FHE.h>
+#include <EncryptedArray.h>
+#include "fhebloom_io.h"
 
 namespace bloomLib 
 {
@@ -34,16 +39,74 @@ namespace bloomLib
     const static char *dir_server_qry = "fhebloom_server_query/";
     const static char *dir_server_res = "fhebloom_server_result/";
 
+    // Client side list of the patients packed into each column layout group
+    const static char *column_layout_file = "column_layout.txt";
+
+    // Client side list of the VCF each patient of a --db_vcf database was built from, kept in dir_client
+    // next to the database directory so neither rsync nor the TCP upload sends it to the server
+    const static char *vcf_sources_file = "vcf_sources.txt";
+
     //Key Settings
-    long p = 59;          // Modulo
-    long L = 3;           // Levels
-    long security = 80;   // security bits
+    const static long p = 59;          // Modulo
+    const static long L = 3;           // Levels
+    const static long security = 80;   // security bits
+
+    // Patient in the encrypted database, chunks are only filled if the database is kept in memory
+    // In column layout an entry is a group of up to nslots patients with one chunk per Bloom position
+    struct DatabaseEntry
+    {
+        string prefix;          // e.g. database_0_10000 or column_0_10000
+        string currentBloom;    // suffix of the query to match against, e.g. 10000
+        bool columnLayout;
+        int numberChunks;
+        vector<Ctxt> chunks;
+    };
+
+    // Tuning knobs of execute, the defaults are the fastest settings
+    struct ExecuteOptions
+    {
+        bool lazyRelinearization = true;    // operands at their lowest level, raw products are summed and relinearized once per patient
+        bool packResults = true;            // counts of all row layout patients in one result container per query
+        bool trimResults = true;            // results are mod-switched to the fewest primes that still decrypt
+        bool compressResults = false;       // results are stored deflated, see serializeCtxt
+        uint32_t minimumLevel = 0;          // database and query chunks with fewer primes are rejected, see multiplicationLevel
+        int tasksPerPatient = 0;            // chunk ranges per patient scheduled as separate tasks, 0: twice the number of threads
+        size_t memoryLimit = 0;             // bytes of ciphertexts resident or in flight, the scheduler throttles to stay below, 0: unlimited
+        int readaheadChunks = 4;            // chunks whose file pages are read ahead when the database is streamed, 0: off
+    };
+
+    // Encrypted query, all queries of a batch are kept in memory during execute
+    // Plaintext queries (relaxed security) carry their bits and encodings of the chunks with set bits instead
+    struct QueryEntry
+    {
+        string name;            // e.g. query_10000 or query_10000_<tag>
+        string currentBloom;    // patients with the same suffix are matched against this query
+        bool plaintext = false;
+        vector<Ctxt> chunks;
+        vector<bool> bits;
+        vector<shared_ptr<DoubleCRT>> encodedChunks;
+    };
     
     Ctxt loadCtChunk(uint32_t chunkNo, const FHEPubKey &publicKey, string prefix);
-    void storeCtResult(Ctxt ctChunk, const FHEPubKey& publicKey, string prefix);
-    void execute(string name, string database_path, string query_path, string path_result, const FHEPubKey& publicKey, EncryptedArray ea);
+    // Level trimming: fresh ciphertexts are dropped to their base level, which still allows the one
+    // multiplication of execute, multiplicationLevel is the number of primes they keep
+    void modDownToBaseLevel(Ctxt& ctxt);
+    uint32_t multiplicationLevel(const FHEPubKey& publicKey);
+
+    uint64_t storeCtResult(const Ctxt& ctChunk, const FHEPubKey& publicKey, string prefix, bool compress = false);
+    void execute(string name, string database_path, string query_path, string path_result, const FHEPubKey& publicKey, const EncryptedArray& ea, const ExecuteOptions& options = ExecuteOptions());
+    void execute(string name, string database_path, const vector<DatabaseEntry>& database, const Ctxt& ctEmpty, string query_path, string path_result, const FHEPubKey& publicKey, const EncryptedArray& ea, const ExecuteOptions& options = ExecuteOptions());
+
+    vector<DatabaseEntry> enumerateDatabase(string database_path);
+    string queryBloom(string queryName);
+    vector<string> packedPatients(const vector<DatabaseEntry>& database, string currentBloom);
+    vector<QueryEntry> loadQueries(string query_path, const FHEPubKey& publicKey, const EncryptedArray& ea, const ExecuteOptions& options);
+    void loadDatabase(string name, string database_path, const FHEPubKey& publicKey, vector<DatabaseEntry>& database, const ExecuteOptions& options);
+
+    void loadKeys(string name, string contextFile, string keyFile, string snapshotFile, bool secret, KeyMaterial& keys);
 
     void removeFiles(string path, string filter);
     vector<string> enumerateFiles(string path, string filter);
-    int getChunkCount(string path, string prefix);
 }
+
+#endif //FHEBLOOM_CONFIG_H
@@ -0,0 +1,637 @@
+// File       fhebloom_io.cpp
+// Brief      Binary ciphertext container and manifest class file of FHEBLOOM approach.
+// 
+// Copyright  BLOOM: Bloom filter based outsourced oblivious matchings
+//            Copyright (C) 2017 Communication and Distributed Systems (COMSYS), RWTH Aachen
+//            
+//            This program is free software: you can redistribute it and/or modify
+//            it under the terms of the GNU Affero General Public License as published
+//            by the Free Software Foundation, either version 3 of the License, or
+//            (at your option) any later version.
+//            
+//            This program is distributed in the hope that it will be useful,
+//            but WITHOUT ANY WARRANTY; without even the implied warranty of
+//            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//            GNU Affero General Public License for more details.
+//            You should have received a copy of the GNU Affero General Public License
+//            along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#include <boost/filesystem.hpp>
+#include <fcntl.h>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <streambuf>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "fhebloom_io.h"
+#include "fhebloom_metrics.h"
+
+namespace fs = boost::filesystem;
+
+namespace bloomLib
+{
+
+    // Read-only stream buffer on top of a memory mapped file, avoids copying the payload
+    class MappedBuffer : public std::streambuf
+    {
+    public:
+        MappedBuffer(const char *data, size_t size)
+        {
+            char *begin = const_cast<char *>(data);
+            setg(begin, begin, begin + size);
+        }
+    };
+
+    uint64_t contextFingerprint(const FHEcontext& context)
+    {
+        // FNV-1a over the parameters that have to match for a ciphertext to be usable
+        uint64_t hash = 14695981039346656037ULL;
+        auto mix = [&hash](uint64_t value)
+        {
+            for (int i = 0; i < 8; i++)
+            {
+                hash ^= (value >> (8*i)) & 0xff;
+                hash *= 1099511628211ULL;
+            }
+        };
+
+        mix(context.zMStar.getM());
+        mix(context.zMStar.getP());
+        mix(context.alMod.getR());
+        for (long i = 0; i < context.numPrimes(); i++)
+            mix(context.ithPrime(i));
+
+        return hash;
+    }
+
+    static CtxtFileHeader ctxtHeader(const Ctxt& ctxt)
+    {
+        const FHEcontext& context = ctxt.getContext();
+
+        CtxtFileHeader header;
+        header.magic = ctxt_file_magic;
+        header.version = ctxt_file_version;
+        header.contextFingerprint = contextFingerprint(context);
+        header.level = static_cast<uint32_t>(ctxt.getPrimeSet().card());
+        header.slots = static_cast<uint32_t>(context.zMStar.getNSlots());
+        header.payloadSize = 0;
+        return header;
+    }
+
+    // The residues are near-uniform below the 55-60 bit primes of the modulus chain, so only the few top bits
+    // of every 64 bit word are zero. Grouping byte i of all words gathers them in the top byte planes, which
+    // deflate shrinks while the lower planes stay incompressible (about 14% overall). A trailing partial word is kept as is.
+    static void shuffleBytes(const char *input, size_t size, char *output, bool forward)
+    {
+        size_t words = size / 8;
+        for (size_t w = 0; w < words; w++)
+            for (size_t b = 0; b < 8; b++)
+            {
+                if (forward)
+                    output[b * words + w] = input[w * 8 + b];
+                else
+                    output[w * 8 + b] = input[b * words + w];
+            }
+        memcpy(output + words * 8, input + words * 8, size - words * 8);
+    }
+
+    static string compressPayload(const string& raw)
+    {
+        string shuffled(raw.size(), '\0');
+        shuffleBytes(raw.data(), raw.size(), &shuffled[0], true);
+
+        uLongf compressedSize = compressBound(static_cast<uLong>(shuffled.size()));
+        string payload(sizeof(uint64_t) + compressedSize, '\0');
+        uint64_t rawSize = raw.size();
+        memcpy(&payload[0], &rawSize, sizeof(rawSize));
+        if (compress2(reinterpret_cast<Bytef *>(&payload[sizeof(rawSize)]), &compressedSize, reinterpret_cast<const Bytef *>(shuffled.data()), static_cast<uLong>(shuffled.size()), Z_BEST_SPEED) != Z_OK)
+            throw runtime_error("Cannot compress ciphertext");
+        payload.resize(sizeof(rawSize) + compressedSize);
+        return payload;
+    }
+
+    static string decompressPayload(const char *data, size_t size, string source)
+    {
+        uint64_t rawSize;
+        if (size < sizeof(rawSize))
+            throw runtime_error("Truncated ciphertext in " + source);
+        memcpy(&rawSize, data, sizeof(rawSize));
+
+        string shuffled(rawSize, '\0');
+        uLongf length = static_cast<uLongf>(rawSize);
+        if (uncompress(reinterpret_cast<Bytef *>(&shuffled[0]), &length, reinterpret_cast<const Bytef *>(data + sizeof(rawSize)), static_cast<uLong>(size - sizeof(rawSize))) != Z_OK || length != rawSize)
+            throw runtime_error("Corrupt compressed ciphertext in " + source);
+
+        string raw(rawSize, '\0');
+        shuffleBytes(shuffled.data(), shuffled.size(), &raw[0], false);
+        return raw;
+    }
+
+    string serializeCtxt(const Ctxt& ctxt, bool compress)
+    {
+        CtxtFileHeader header = ctxtHeader(ctxt);
+
+        ostringstream payloadStream;
+        ctxt.write(payloadStream);
+        string payload = payloadStream.str();
+        if (compress)
+        {
+            header.magic = ctxt_compressed_magic;
+            payload = compressPayload(payload);
+        }
+        header.payloadSize = payload.size();
+
+        string serialized(reinterpret_cast<const char *>(&header), sizeof(header));
+        serialized += payload;
+        return serialized;
+    }
+
+    void writeCtxt(ostream& stream, const Ctxt& ctxt, bool compress)
+    {
+        if (compress)
+        {
+            string serialized = serializeCtxt(ctxt, true);
+            stream.write(serialized.data(), serialized.size());
+            return;
+        }
+
+        CtxtFileHeader header = ctxtHeader(ctxt);
+
+        // payload size is only known afterwards, patch the header once the ciphertext is written
+        streampos start = stream.tellp();
+        stream.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        ctxt.write(stream);
+        streampos end = stream.tellp();
+        header.payloadSize = static_cast<uint64_t>(end - start) - sizeof(header);
+        stream.seekp(start);
+        stream.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        stream.seekp(end);
+    }
+
+    void readCtxt(const char *data, size_t size, Ctxt& ctxt, string source, uint32_t minimumLevel)
+    {
+        if (size < sizeof(CtxtFileHeader))
+            throw runtime_error("Truncated ciphertext in " + source);
+
+        CtxtFileHeader header;
+        memcpy(&header, data, sizeof(header));
+
+        if ((header.magic != ctxt_file_magic && header.magic != ctxt_compressed_magic) || header.version != ctxt_file_version)
+            throw runtime_error("Unsupported ciphertext format in " + source);
+        if (header.contextFingerprint != contextFingerprint(ctxt.getContext()))
+            throw runtime_error("Ciphertext was encrypted under a different context: " + source);
+        if (header.slots != static_cast<uint32_t>(ctxt.getContext().zMStar.getNSlots()))
+            throw runtime_error("Slot count mismatch in " + source);
+        if (header.level < minimumLevel)
+            throw runtime_error("Ciphertext in " + source + " has " + to_string(header.level) + " primes, one multiplication needs " + to_string(minimumLevel));
+        if (sizeof(header) + header.payloadSize > size)
+            throw runtime_error("Truncated ciphertext in " + source);
+
+        if (header.magic == ctxt_compressed_magic)
+        {
+            string raw = decompressPayload(data + sizeof(header), header.payloadSize, source);
+            MappedBuffer buffer(raw.data(), raw.size());
+            istream ctStream(&buffer);
+            ctxt.read(ctStream);
+            return;
+        }
+
+        MappedBuffer buffer(data + sizeof(header), header.payloadSize);
+        istream ctStream(&buffer);
+        ctxt.read(ctStream);
+    }
+
+    CtxtContainer::CtxtContainer(string containerFilename, uint32_t minimumLevel) : filename(containerFilename), data(nullptr), length(0), numberChunks(0), requiredLevel(minimumLevel)
+    {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw runtime_error("Cannot open ciphertext container " + filename);
+
+        struct stat fileStat;
+        fstat(fd, &fileStat);
+        length = static_cast<size_t>(fileStat.st_size);
+
+        if (length < sizeof(ContainerHeader))
+        {
+            close(fd);
+            throw runtime_error("Truncated ciphertext container " + filename);
+        }
+
+        void *mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED)
+            throw runtime_error("Cannot map ciphertext container " + filename);
+        data = static_cast<const char *>(mapping);
+
+        ContainerHeader header;
+        memcpy(&header, data, sizeof(header));
+        if (header.magic != container_file_magic || header.version != container_file_version
+            || sizeof(header) + header.numberChunks * sizeof(ContainerIndexEntry) > length)
+        {
+            munmap(mapping, length);
+            throw runtime_error("Unsupported ciphertext container " + filename);
+        }
+        numberChunks = header.numberChunks;
+    }
+
+    CtxtContainer::~CtxtContainer()
+    {
+        munmap(const_cast<char *>(data), length);
+    }
+
+    const char *CtxtContainer::chunk(uint32_t chunkNo, uint64_t& size) const
+    {
+        if (chunkNo >= numberChunks)
+            throw out_of_range("Chunk " + to_string(chunkNo) + " not in " + filename);
+
+        ContainerIndexEntry entry;
+        memcpy(&entry, data + sizeof(ContainerHeader) + chunkNo * sizeof(ContainerIndexEntry), sizeof(entry));
+        if (entry.offset + entry.size > length)
+            throw runtime_error("Truncated ciphertext container " + filename);
+
+        size = entry.size;
+        return data + entry.offset;
+    }
+
+    void CtxtContainer::load(uint32_t chunkNo, Ctxt& ctxt) const
+    {
+        StepTimer timer(step_load);
+        uint64_t size;
+        const char *chunkData = chunk(chunkNo, size);
+        readCtxt(chunkData, size, ctxt, filename, requiredLevel);
+    }
+
+    void CtxtContainer::readahead(uint32_t first, uint32_t last) const
+    {
+        last = min(last, numberChunks);
+        if (first >= last)
+            return;
+
+        // chunks are stored back to back, the kernel reads the pages asynchronously while earlier chunks are computed
+        uint64_t firstSize, lastSize;
+        const char *begin = chunk(first, firstSize);
+        const char *end = chunk(last - 1, lastSize) + lastSize;
+        static const uintptr_t pageSize = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+        const char *aligned = reinterpret_cast<const char *>(reinterpret_cast<uintptr_t>(begin) & ~(pageSize - 1));
+        madvise(const_cast<char *>(aligned), static_cast<size_t>(end - aligned), MADV_WILLNEED);
+    }
+
+    CtxtFileHeader CtxtContainer::header(uint32_t chunkNo) const
+    {
+        uint64_t size;
+        const char *chunkData = chunk(chunkNo, size);
+        if (size < sizeof(CtxtFileHeader))
+            throw runtime_error("Truncated ciphertext in " + filename);
+
+        CtxtFileHeader header;
+        memcpy(&header, chunkData, sizeof(header));
+        return header;
+    }
+
+    string CtxtContainer::serialized(uint32_t chunkNo) const
+    {
+        uint64_t size;
+        const char *chunkData = chunk(chunkNo, size);
+        return string(chunkData, size);
+    }
+
+    CtxtContainerWriter::CtxtContainerWriter(string containerFilename, uint32_t containerChunks, bool compressChunks) : filename(containerFilename), numberChunks(containerChunks), compress(compressChunks)
+    {
+        containerFile.open(filename, fstream::out|fstream::trunc|fstream::binary);
+        if (!containerFile.is_open())
+            throw runtime_error("Cannot write ciphertext container " + filename);
+
+        ContainerHeader header = {container_file_magic, container_file_version, numberChunks, 0};
+        containerFile.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+        // reserve space for the index, it is filled in by close()
+        vector<ContainerIndexEntry> placeholder(numberChunks, ContainerIndexEntry{0, 0});
+        containerFile.write(reinterpret_cast<const char *>(placeholder.data()), placeholder.size() * sizeof(ContainerIndexEntry));
+    }
+
+    void CtxtContainerWriter::append(const Ctxt& ctxt)
+    {
+        if (index.size() == numberChunks)
+            throw out_of_range("Too many chunks for ciphertext container " + filename);
+
+        StepTimer timer(step_store);
+        uint64_t offset = static_cast<uint64_t>(containerFile.tellp());
+        writeCtxt(containerFile, ctxt, compress);
+        index.push_back(ContainerIndexEntry{offset, static_cast<uint64_t>(containerFile.tellp()) - offset});
+    }
+
+    void CtxtContainerWriter::append(const string& serialized)
+    {
+        if (index.size() == numberChunks)
+            throw out_of_range("Too many chunks for ciphertext container " + filename);
+
+        StepTimer timer(step_store);
+        uint64_t offset = static_cast<uint64_t>(containerFile.tellp());
+        containerFile.write(serialized.data(), serialized.size());
+        index.push_back(ContainerIndexEntry{offset, serialized.size()});
+    }
+
+    uint64_t CtxtContainerWriter::close()
+    {
+        if (index.size() != numberChunks)
+            throw runtime_error("Missing chunks in ciphertext container " + filename);
+
+        uint64_t bytes = static_cast<uint64_t>(containerFile.tellp());
+        containerFile.seekp(sizeof(ContainerHeader));
+        containerFile.write(reinterpret_cast<const char *>(index.data()), index.size() * sizeof(ContainerIndexEntry));
+        containerFile.close();
+
+        if (containerFile.fail())
+            throw runtime_error("Cannot write ciphertext container " + filename);
+
+        return bytes;
+    }
+
+    BloomFile::BloomFile(string bloomFilename) : filename(bloomFilename), data(nullptr), length(0), mapped(false)
+    {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw runtime_error("Cannot open Bloom filter " + filename);
+
+        struct stat fileStat;
+        fstat(fd, &fileStat);
+        length = static_cast<size_t>(fileStat.st_size);
+
+        // an empty filter has no mapping
+        if (length > 0)
+        {
+            void *mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED)
+            {
+                close(fd);
+                throw runtime_error("Cannot map Bloom filter " + filename);
+            }
+            madvise(mapping, length, MADV_SEQUENTIAL);
+            data = static_cast<const unsigned char *>(mapping);
+            mapped = true;
+        }
+        close(fd);
+    }
+
+    BloomFile::BloomFile(vector<unsigned char> bloomBytes) : bytes(move(bloomBytes)), data(bytes.data()), length(bytes.size()), mapped(false)
+    {
+    }
+
+    BloomFile::~BloomFile()
+    {
+        if (mapped)
+            munmap(const_cast<unsigned char *>(data), length);
+    }
+
+    long BloomFile::setBits() const
+    {
+        long count = 0;
+        for (size_t i = 0; i < length; i++)
+            count += __builtin_popcount(data[i]);
+        return count;
+    }
+
+    void BloomFile::decodeChunk(uint32_t chunkNo, vector<long>& slots) const
+    {
+        // the slot vector is reused between chunks, the last chunk is padded with zeros
+        size_t chunkSize = slots.size();
+        size_t first = chunkNo * chunkSize;
+        size_t last = min(first + chunkSize, size());
+
+        size_t s = 0;
+        for (size_t b = first; b < last; b++, s++)
+            slots[s] = (data[b / 8] >> (7 - b % 8)) & 0x1;
+        for (; s < chunkSize; s++)
+            slots[s] = 0;
+    }
+
+    void BloomFile::decode(vector<bool>& bloom) const
+    {
+        bloom.assign(size(), false);
+        for (size_t b = 0; b < bloom.size(); b++)
+            bloom[b] = (data[b / 8] >> (7 - b % 8)) & 0x1;
+    }
+
+    uint64_t writePlainQuery(string filename, const vector<bool>& bloom)
+    {
+        PlainQueryHeader header = {plain_query_magic, plain_query_version, bloom.size()};
+
+        // same bit order as the Bloom filter files, the first bit is the MSB of the first byte
+        vector<char> bytes((bloom.size() + 7) / 8, 0);
+        for (size_t b = 0; b < bloom.size(); b++)
+            if (bloom[b])
+                bytes[b / 8] |= static_cast<char>(0x80 >> (b % 8));
+
+        fstream queryFile(filename, fstream::out|fstream::trunc|fstream::binary);
+        if (!queryFile.is_open())
+            throw runtime_error("Cannot write plaintext query " + filename);
+        queryFile.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        queryFile.write(bytes.data(), bytes.size());
+        queryFile.close();
+
+        return sizeof(header) + bytes.size();
+    }
+
+    bool isPlainQuery(string filename)
+    {
+        PlainQueryHeader header;
+        fstream queryFile(filename, fstream::in|fstream::binary);
+        queryFile.read(reinterpret_cast<char *>(&header), sizeof(header));
+        return queryFile.good() && header.magic == plain_query_magic;
+    }
+
+    void readPlainQuery(string filename, vector<bool>& bloom)
+    {
+        PlainQueryHeader header;
+        fstream queryFile(filename, fstream::in|fstream::binary);
+        queryFile.read(reinterpret_cast<char *>(&header), sizeof(header));
+        if (!queryFile.good() || header.magic != plain_query_magic || header.version != plain_query_version)
+            throw runtime_error("Unsupported plaintext query " + filename);
+
+        vector<char> bytes((header.length + 7) / 8);
+        queryFile.read(bytes.data(), bytes.size());
+        if (!queryFile.good())
+            throw runtime_error("Truncated plaintext query " + filename);
+
+        bloom.assign(header.length, false);
+        for (size_t b = 0; b < bloom.size(); b++)
+            bloom[b] = (bytes[b / 8] >> (7 - b % 8)) & 0x1;
+    }
+
+    void writeKeySnapshot(string filename, const FHEcontext& context, const ZZX& G, const FHEPubKey& key, bool secret)
+    {
+        stringstream gText;
+        gText << G;
+        string gString = gText.str();
+
+        // write to a temporary file first, a concurrently starting process falls back to the text keys
+        fstream snapshotFile(filename + ".tmp", fstream::out|fstream::trunc|fstream::binary);
+        if (!snapshotFile.is_open())
+            throw runtime_error("Cannot write key snapshot " + filename);
+
+        KeySnapshotHeader header = {key_snapshot_magic, key_snapshot_version, secret ? 1u : 0u, 0, gString.size()};
+        snapshotFile.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        writeContextBaseBinary(snapshotFile, context);
+        writeContextBinary(snapshotFile, context);
+        snapshotFile.write(gString.data(), gString.size());
+        if (secret)
+            writeSecKeyBinary(snapshotFile, static_cast<const FHESecKey&>(key));
+        else
+            writePubKeyBinary(snapshotFile, key);
+        snapshotFile.close();
+
+        fs::rename(filename + ".tmp", filename);
+    }
+
+    bool readKeySnapshot(string filename, KeyMaterial& keys, bool secret)
+    {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat fileStat;
+        fstat(fd, &fileStat);
+        size_t length = static_cast<size_t>(fileStat.st_size);
+        void *mapping = length >= sizeof(KeySnapshotHeader) ? mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (mapping == MAP_FAILED)
+            return false;
+
+        const char *data = static_cast<const char *>(mapping);
+        KeySnapshotHeader header;
+        memcpy(&header, data, sizeof(header));
+        if (header.magic != key_snapshot_magic || header.version != key_snapshot_version || header.secret != (secret ? 1u : 0u))
+        {
+            munmap(mapping, length);
+            return false;
+        }
+
+        // the key switching matrices are parsed straight from the mapping
+        MappedBuffer buffer(data + sizeof(header), length - sizeof(header));
+        istream snapshotStream(&buffer);
+
+        unsigned long m, p, r;
+        vector<long> gens, ords;
+        readContextBaseBinary(snapshotStream, m, p, r, gens, ords);
+        keys.context.reset(new FHEcontext(m, p, r, gens, ords));
+        readContextBinary(snapshotStream, *keys.context);
+
+        string gString(header.gSize, '\0');
+        snapshotStream.read(&gString[0], gString.size());
+        stringstream gText(gString);
+        gText >> keys.G;
+
+        if (secret)
+        {
+            keys.secretKey.reset(new FHESecKey(*keys.context));
+            readSecKeyBinary(snapshotStream, *keys.secretKey);
+        }
+        else
+        {
+            keys.publicKey.reset(new FHEPubKey(*keys.context));
+            readPubKeyBinary(snapshotStream, *keys.publicKey);
+        }
+        bool complete = snapshotStream.good();
+        munmap(mapping, length);
+
+        if (!complete)
+            throw runtime_error("Truncated key snapshot " + filename);
+
+        keys.ea.reset(new EncryptedArray(*keys.context, keys.G));
+        return true;
+    }
+
+    void writeManifest(string path, vector<ManifestEntry> entries, ManifestVersion version)
+    {
+        sort(entries.begin(), entries.end(), [](const ManifestEntry& a, const ManifestEntry& b) { return a.name < b.name; });
+
+        // write to a temporary file first so readers never see a partial manifest
+        string filename = path + manifest_file;
+        fstream manifestFile(filename + ".tmp", fstream::out|fstream::trunc);
+        if (!manifestFile.is_open())
+            throw runtime_error("Cannot write manifest " + filename);
+
+        manifestFile << "# FHEBLOOM manifest v2: name chunks bytes version" << endl;
+        manifestFile << "# lineage " << hex << version.lineage << dec << " version " << version.version << endl;
+        for (const ManifestEntry& entry : entries)
+            manifestFile << entry.name << " " << entry.numberChunks << " " << entry.bytes << " " << entry.version << endl;
+        manifestFile.close();
+
+        fs::rename(filename + ".tmp", filename);
+    }
+
+    vector<ManifestEntry> readManifest(string path)
+    {
+        vector<ManifestEntry> entries;
+        fstream manifestFile(path + manifest_file, fstream::in);
+        if (!manifestFile.is_open())
+            return entries;
+
+        string line;
+        while (getline(manifestFile, line))
+        {
+            if (line.empty() || line[0] == '#')
+                continue;
+
+            // v1 manifests have no version column
+            ManifestEntry entry;
+            stringstream fields(line);
+            if (fields >> entry.name >> entry.numberChunks >> entry.bytes)
+            {
+                if (!(fields >> entry.version))
+                    entry.version = 0;
+                entries.push_back(entry);
+            }
+        }
+
+        return entries;
+    }
+
+    ManifestVersion readManifestVersion(string path)
+    {
+        ManifestVersion version;
+        fstream manifestFile(path + manifest_file, fstream::in);
+
+        string line;
+        while (getline(manifestFile, line) && !line.empty() && line[0] == '#')
+        {
+            string hash, key, versionKey;
+            stringstream fields(line);
+            if (fields >> hash >> key && key == "lineage")
+                fields >> hex >> version.lineage >> dec >> versionKey >> version.version;
+        }
+
+        return version;
+    }
+
+    uint64_t newManifestLineage()
+    {
+        random_device random;
+        return (static_cast<uint64_t>(random()) << 32) ^ random();
+    }
+
+    size_t manifestStamp(string path)
+    {
+        // Hash over the manifest and the modification times of all listed containers,
+        // 0 while the manifest or one of its containers is missing or incomplete
+        if (!fs::exists(path + manifest_file))
+            return 0;
+
+        stringstream stamp;
+        stamp << fs::last_write_time(path + manifest_file) << ";";
+        for (const ManifestEntry& entry : readManifest(path))
+        {
+            fs::path container = fs::path(path) / (entry.name + ".enc");
+            boost::system::error_code error;
+            uint64_t bytes = fs::file_size(container, error);
+            if (error || bytes != entry.bytes)
+                return 0;
+            stamp << entry.name << ":" << bytes << ":" << fs::last_write_time(container) << ";";
+        }
+
+        return std::hash<string>()(stamp.str());
+    }
+}
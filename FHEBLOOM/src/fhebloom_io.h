@@ -0,0 +1,208 @@
+// File       fhebloom_io.h
+// Brief      Binary ciphertext container and manifest header file of FHEBLOOM approach.
+// 
+// Copyright  BLOOM: Bloom filter based outsourced oblivious matchings
+//            Copyright (C) 2017 Communication and Distributed Systems (COMSYS), RWTH Aachen
+//            
+//            This program is free software: you can redistribute it and/or modify
+//            it under the terms of the GNU Affero General Public License as published
+//            by the Free Software Foundation, either version 3 of the License, or
+//            (at your option) any later version.
+//            
+//            This program is distributed in the hope that it will be useful,
+//            but WITHOUT ANY WARRANTY; without even the implied warranty of
+//            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//            GNU Affero General Public License for more details.
+//            You should have received a copy of the GNU Affero General Public License
+//            along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FHEBLOOM_IO_H
+#define FHEBLOOM_IO_H
+
+#include <EncryptedArray.h>
+#include <FHE.h>
+#include <cstdint>
+#include <memory>
+
+namespace bloomLib
+{
+    const static uint32_t ctxt_file_magic = 0x54434246;        // "FBCT"
+    const static uint32_t ctxt_file_version = 1;
+    const static uint32_t ctxt_compressed_magic = 0x5a434246;  // "FBCZ"
+    const static uint32_t container_file_magic = 0x43434246;   // "FBCC"
+    const static uint32_t container_file_version = 1;
+    const static uint32_t plain_query_magic = 0x51504246;      // "FBPQ"
+    const static uint32_t plain_query_version = 1;
+    const static char *manifest_file = "manifest.txt";
+    const static uint32_t key_snapshot_magic = 0x4b534246;     // "FBSK"
+    const static uint32_t key_snapshot_version = 1;
+    const static char *public_snapshot_file = "helib_public.bin";
+    const static char *secret_snapshot_file = "helib_secret.bin";
+
+    // Fixed size header in front of every binary ciphertext, followed by payloadSize bytes of HElib binary data.
+    // Compressed ciphertexts use ctxt_compressed_magic, their payload is the uncompressed size (uint64)
+    // followed by the deflated HElib binary data with the bytes of every 8 byte word grouped into planes
+    struct CtxtFileHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t contextFingerprint;   // hash over m, p, r and the modulus chain
+        uint32_t level;                // number of primes the ciphertext is defined over
+        uint32_t slots;
+        uint64_t payloadSize;
+    };
+
+    // Binary snapshot of context, G factor and public or secret key: header, HElib binary context,
+    // G as NTL text of gSize bytes, HElib binary key
+    struct KeySnapshotHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t secret;               // 1 if the key is a secret key
+        uint32_t reserved;
+        uint64_t gSize;
+    };
+
+    // Context, G factor, key and EncryptedArray of one party, the objects reference each other
+    struct KeyMaterial
+    {
+        unique_ptr<FHEcontext> context;
+        unique_ptr<FHEPubKey> publicKey;   // server
+        unique_ptr<FHESecKey> secretKey;   // client
+        ZZX G;
+        unique_ptr<EncryptedArray> ea;
+
+        const FHEPubKey& pubKey() const { return secretKey ? *secretKey : *publicKey; }
+    };
+
+    // A container holds all chunks of one patient (or query/result): header, offset index, ciphertexts
+    struct ContainerHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t numberChunks;
+        uint32_t reserved;
+    };
+
+    struct ContainerIndexEntry
+    {
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    // Relaxed security mode: query Bloom filter sent in the clear, followed by the bits packed MSB first
+    struct PlainQueryHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t length;               // number of Bloom filter bits
+    };
+
+    // One line of a directory manifest, name is the container file name without ".enc",
+    // version is the manifest version in which the container was last written
+    struct ManifestEntry
+    {
+        string name;
+        uint32_t numberChunks;
+        uint64_t bytes;
+        uint64_t version = 0;
+    };
+
+    // A database keeps its lineage across incremental updates, a full re-encryption starts a new one.
+    // Containers of two manifests with the same lineage and entry version are identical.
+    struct ManifestVersion
+    {
+        uint64_t lineage = 0;
+        uint64_t version = 0;
+    };
+
+    // Memory mapped container, chunks are deserialized straight from the mapping
+    class CtxtContainer
+    {
+    public:
+        // chunks with fewer primes than minimumLevel are rejected on load
+        explicit CtxtContainer(string containerFilename, uint32_t minimumLevel = 0);
+        ~CtxtContainer();
+        CtxtContainer(const CtxtContainer&) = delete;
+        CtxtContainer& operator=(const CtxtContainer&) = delete;
+
+        uint32_t size() const { return numberChunks; }
+        void load(uint32_t chunkNo, Ctxt& ctxt) const;
+        void readahead(uint32_t first, uint32_t last) const;   // asks the kernel to read the pages of chunks [first, last) ahead, load still deserializes them
+        CtxtFileHeader header(uint32_t chunkNo) const;
+        string serialized(uint32_t chunkNo) const;     // chunk as written by serializeCtxt, e.g. to copy it into another container
+
+    private:
+        const char *chunk(uint32_t chunkNo, uint64_t& size) const;
+
+        string filename;
+        const char *data;
+        size_t length;
+        uint32_t numberChunks;
+        uint32_t requiredLevel;
+    };
+
+    // Writes chunks sequentially, the offset index is patched in on close
+    class CtxtContainerWriter
+    {
+    public:
+        CtxtContainerWriter(string containerFilename, uint32_t containerChunks, bool compressChunks = false);
+
+        void append(const Ctxt& ctxt);
+        void append(const string& serialized);     // output of serializeCtxt, e.g. compressed outside an ordered section
+        uint64_t close();
+
+    private:
+        string filename;
+        uint32_t numberChunks;
+        bool compress;
+        fstream containerFile;
+        vector<ContainerIndexEntry> index;
+    };
+
+    // Memory mapped raw Bloom filter file or a filter built in memory with the same byte layout,
+    // bits are decoded MSB first straight into slot vectors
+    class BloomFile
+    {
+    public:
+        explicit BloomFile(string bloomFilename);
+        explicit BloomFile(vector<unsigned char> bloomBytes);
+        ~BloomFile();
+        BloomFile(const BloomFile&) = delete;
+        BloomFile& operator=(const BloomFile&) = delete;
+
+        size_t size() const { return 8 * length; }
+        uint32_t chunkCount(long chunkSize) const { return static_cast<uint32_t>((size() + chunkSize - 1) / chunkSize); }
+        long setBits() const;
+        void decodeChunk(uint32_t chunkNo, vector<long>& slots) const;
+        void decode(vector<bool>& bloom) const;
+
+    private:
+        string filename;
+        vector<unsigned char> bytes;   // only used for filters built in memory
+        const unsigned char *data;
+        size_t length;
+        bool mapped;
+    };
+
+    uint64_t contextFingerprint(const FHEcontext& context);
+
+    void writeCtxt(ostream& stream, const Ctxt& ctxt, bool compress = false);
+    string serializeCtxt(const Ctxt& ctxt, bool compress = false);
+    void readCtxt(const char *data, size_t size, Ctxt& ctxt, string source, uint32_t minimumLevel = 0);
+
+    uint64_t writePlainQuery(string filename, const vector<bool>& bloom);
+    bool isPlainQuery(string filename);
+    void readPlainQuery(string filename, vector<bool>& bloom);
+
+    void writeKeySnapshot(string filename, const FHEcontext& context, const ZZX& G, const FHEPubKey& key, bool secret);
+    bool readKeySnapshot(string filename, KeyMaterial& keys, bool secret);
+
+    void writeManifest(string path, vector<ManifestEntry> entries, ManifestVersion version = ManifestVersion());
+    vector<ManifestEntry> readManifest(string path);
+    ManifestVersion readManifestVersion(string path);
+    uint64_t newManifestLineage();
+    size_t manifestStamp(string path);
+}
+
+#endif //FHEBLOOM_IO_H
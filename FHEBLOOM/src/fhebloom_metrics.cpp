@@ -0,0 +1,169 @@
+// File       fhebloom_metrics.cpp
+// Brief      Per-thread step timers and metrics export class file of FHEBLOOM approach.
+// 
+// Copyright  BLOOM: Bloom filter based outsourced oblivious matchings
+//            Copyright (C) 2017 Communication and Distributed Systems (COMSYS), RWTH Aachen
+//            
+//            This program is free software: you can redistribute it and/or modify
+//            it under the terms of the GNU Affero General Public License as published
+//            by the Free Software Foundation, either version 3 of the License, or
+//            (at your option) any later version.
+//            
+//            This program is distributed in the hope that it will be useful,
+//            but WITHOUT ANY WARRANTY; without even the implied warranty of
+//            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//            GNU Affero General Public License for more details.
+//            You should have received a copy of the GNU Affero General Public License
+//            along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#include <boost/filesystem.hpp>
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#include "fhebloom_metrics.h"
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+namespace bloomLib
+{
+    // Counters of one thread, written only by that thread; the padding keeps
+    // the counters of two threads off a shared cache line without aligned new (C++17)
+    struct ThreadCounters
+    {
+        char padding[64];
+        atomic<uint64_t> count[step_count];
+        atomic<uint64_t> nanoseconds[step_count];
+    };
+
+    // counters of finished threads are kept, OpenMP reuses its pool so the list stays short
+    static mutex registryMutex;
+    static vector<unique_ptr<ThreadCounters>> registry;
+
+    static mutex noiseMutex;
+    static uint64_t noiseResults = 0;
+    static double noiseSum = 0;
+    static double noiseMin = numeric_limits<double>::infinity();
+
+    static ThreadCounters& threadCounters()
+    {
+        thread_local ThreadCounters *counters = nullptr;
+        if (!counters)
+        {
+            unique_ptr<ThreadCounters> created(new ThreadCounters);
+            for (int i = 0; i < step_count; i++)
+            {
+                created->count[i].store(0);
+                created->nanoseconds[i].store(0);
+            }
+            lock_guard<mutex> lock(registryMutex);
+            registry.push_back(move(created));
+            counters = registry.back().get();
+        }
+        return *counters;
+    }
+
+    const char *metricStepName(MetricStep step)
+    {
+        static const char *names[step_count] = {"load", "multiply", "add", "relinearize", "total_sums", "store", "encrypt", "decrypt"};
+        return names[step];
+    }
+
+    void recordStep(MetricStep step, uint64_t nanoseconds)
+    {
+        ThreadCounters& counters = threadCounters();
+        counters.count[step].fetch_add(1, memory_order_relaxed);
+        counters.nanoseconds[step].fetch_add(nanoseconds, memory_order_relaxed);
+    }
+
+    void recordNoiseBudget(const Ctxt& ctxt)
+    {
+        // log_of_ratio is the natural log of noise over modulus, the budget is what is left until it reaches 1
+        double bits = -ctxt.log_of_ratio() / log(2.0);
+        lock_guard<mutex> lock(noiseMutex);
+        noiseResults++;
+        noiseSum += bits;
+        noiseMin = min(noiseMin, bits);
+    }
+
+    static void replaceFile(string filename, const string& content)
+    {
+        string tmp = filename + ".tmp";
+        {
+            ofstream file(tmp, ios::trunc);
+            if (!file.is_open())
+                throw runtime_error("Could not write metrics to " + filename);
+            file << content;
+        }
+        fs::rename(tmp, filename);
+    }
+
+    void writeMetrics(string prefix)
+    {
+        // consistent enough for monitoring, counters keep running while they are read
+        vector<vector<pair<uint64_t, uint64_t>>> threads;
+        {
+            lock_guard<mutex> lock(registryMutex);
+            for (const unique_ptr<ThreadCounters>& counters : registry)
+            {
+                vector<pair<uint64_t, uint64_t>> steps;
+                for (int i = 0; i < step_count; i++)
+                    steps.emplace_back(counters->count[i].load(memory_order_relaxed), counters->nanoseconds[i].load(memory_order_relaxed));
+                threads.push_back(steps);
+            }
+        }
+
+        uint64_t results;
+        double mean, minimum;
+        {
+            lock_guard<mutex> lock(noiseMutex);
+            results = noiseResults;
+            mean = results ? noiseSum / results : 0;
+            minimum = noiseMin;
+        }
+
+        ostringstream json, prometheus;
+        json.precision(9);
+        prometheus.precision(9);
+        json << "{\n  \"steps\": {";
+        prometheus << "# HELP fhebloom_step_seconds_total Time spent per step and thread\n# TYPE fhebloom_step_seconds_total counter\n";
+        for (int i = 0; i < step_count; i++)
+        {
+            uint64_t count = 0, nanoseconds = 0;
+            ostringstream perThread;
+            for (size_t t = 0; t < threads.size(); t++)
+            {
+                count += threads.at(t).at(i).first;
+                nanoseconds += threads.at(t).at(i).second;
+                perThread << (t ? ", " : "") << "{\"thread\": " << t << ", \"count\": " << threads.at(t).at(i).first << ", \"seconds\": " << threads.at(t).at(i).second * 1e-9 << "}";
+                prometheus << "fhebloom_step_seconds_total{step=\"" << metricStepName(MetricStep(i)) << "\",thread=\"" << t << "\"} " << threads.at(t).at(i).second * 1e-9 << "\n";
+            }
+            json << (i ? "," : "") << "\n    \"" << metricStepName(MetricStep(i)) << "\": {\"count\": " << count << ", \"seconds\": " << nanoseconds * 1e-9 << ", \"threads\": [" << perThread.str() << "]}";
+        }
+        json << "\n  },\n  \"noise_budget_bits\": {\"results\": " << results;
+        if (results)
+            json << ", \"min\": " << minimum << ", \"mean\": " << mean;
+        else
+            json << ", \"min\": null, \"mean\": null";
+        json << "}\n}\n";
+
+        prometheus << "# HELP fhebloom_step_total Occurrences per step and thread\n# TYPE fhebloom_step_total counter\n";
+        for (int i = 0; i < step_count; i++)
+            for (size_t t = 0; t < threads.size(); t++)
+                prometheus << "fhebloom_step_total{step=\"" << metricStepName(MetricStep(i)) << "\",thread=\"" << t << "\"} " << threads.at(t).at(i).first << "\n";
+        prometheus << "# HELP fhebloom_results_total Result ciphertexts with a recorded noise budget\n# TYPE fhebloom_results_total counter\n"
+                   << "fhebloom_results_total " << results << "\n";
+        if (results)
+            prometheus << "# HELP fhebloom_noise_budget_bits Remaining noise budget of the result ciphertexts\n# TYPE fhebloom_noise_budget_bits gauge\n"
+                       << "fhebloom_noise_budget_bits{stat=\"min\"} " << minimum << "\n"
+                       << "fhebloom_noise_budget_bits{stat=\"mean\"} " << mean << "\n";
+
+        replaceFile(prefix + ".json", json.str());
+        replaceFile(prefix + ".prom", prometheus.str());
+    }
+}
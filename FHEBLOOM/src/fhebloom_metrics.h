@@ -0,0 +1,70 @@
+// File       fhebloom_metrics.h
+// Brief      Per-thread step timers and metrics export header file of FHEBLOOM approach.
+// 
+// Copyright  BLOOM: Bloom filter based outsourced oblivious matchings
+//            Copyright (C) 2017 Communication and Distributed Systems (COMSYS), RWTH Aachen
+//            
+//            This program is free software: you can redistribute it and/or modify
+//            it under the terms of the GNU Affero General Public License as published
+//            by the Free Software Foundation, either version 3 of the License, or
+//            (at your option) any later version.
+//            
+//            This program is distributed in the hope that it will be useful,
+//            but WITHOUT ANY WARRANTY; without even the implied warranty of
+//            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//            GNU Affero General Public License for more details.
+//            You should have received a copy of the GNU Affero General Public License
+//            along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FHEBLOOM_METRICS_H
+#define FHEBLOOM_METRICS_H
+
+#include <FHE.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace bloomLib
+{
+    // Timed steps of execute and of the client loops
+    enum MetricStep
+    {
+        step_load,          // ciphertext read from a container
+        step_multiply,      // ciphertext or plaintext product
+        step_add,           // ciphertext sum
+        step_relinearize,   // relinearization and mod switching of a lazy sum
+        step_total_sums,    // totalSums of row layout results, replicateAll of column layout queries
+        step_store,         // ciphertext appended to a container
+        step_encrypt,
+        step_decrypt,
+        step_count
+    };
+
+    const char *metricStepName(MetricStep step);
+
+    // Adds one occurrence of step to the calling thread's counters, each thread only writes its own
+    void recordStep(MetricStep step, uint64_t nanoseconds);
+
+    // Remaining noise budget in bits of a result ciphertext
+    void recordNoiseBudget(const Ctxt& ctxt);
+
+    // JSON summary and Prometheus text exposition of all counters so far, written atomically
+    void writeMetrics(std::string prefix);
+
+    // Times its scope as one occurrence of step
+    class StepTimer
+    {
+    public:
+        explicit StepTimer(MetricStep timedStep) : step(timedStep), start(std::chrono::steady_clock::now()) {}
+        ~StepTimer() { recordStep(step, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count()); }
+        StepTimer(const StepTimer&) = delete;
+        StepTimer& operator=(const StepTimer&) = delete;
+
+    private:
+        MetricStep step;
+        std::chrono::steady_clock::time_point start;
+    };
+}
+
+#endif //FHEBLOOM_METRICS_H
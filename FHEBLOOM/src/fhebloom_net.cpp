@@ -0,0 +1,537 @@
+// File       fhebloom_net.cpp
+// Brief      Length-prefixed TCP transfer channel class file of FHEBLOOM approach.
+// 
+// Copyright  BLOOM: Bloom filter based outsourced oblivious matchings
+//            Copyright (C) 2017 Communication and Distributed Systems (COMSYS), RWTH Aachen
+//            
+//            This program is free software: you can redistribute it and/or modify
+//            it under the terms of the GNU Affero General Public License as published
+//            by the Free Software Foundation, either version 3 of the License, or
+//            (at your option) any later version.
+//            
+//            This program is distributed in the hope that it will be useful,
+//            but WITHOUT ANY WARRANTY; without even the implied warranty of
+//            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//            GNU Affero General Public License for more details.
+//            You should have received a copy of the GNU Affero General Public License
+//            along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <boost/filesystem.hpp>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <set>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "fhebloom_io.h"
+#include "fhebloom_net.h"
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+namespace bloomLib
+{
+    FrameConnection::FrameConnection(int socketFd) : fd(socketFd)
+    {
+        int flag = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    }
+
+    FrameConnection::~FrameConnection()
+    {
+        close(fd);
+    }
+
+    unique_ptr<FrameConnection> FrameConnection::connectTo(string host, int port)
+    {
+        addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        addrinfo *addresses = nullptr;
+        if (getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &addresses) != 0)
+            throw runtime_error("Cannot resolve " + host);
+
+        int socketFd = -1;
+        for (addrinfo *address = addresses; address != nullptr && socketFd < 0; address = address->ai_next)
+        {
+            socketFd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+            if (socketFd >= 0 && connect(socketFd, address->ai_addr, address->ai_addrlen) != 0)
+            {
+                close(socketFd);
+                socketFd = -1;
+            }
+        }
+        freeaddrinfo(addresses);
+
+        if (socketFd < 0)
+            throw runtime_error("Cannot connect to " + host + ":" + to_string(port));
+        return unique_ptr<FrameConnection>(new FrameConnection(socketFd));
+    }
+
+    void FrameConnection::send(uint32_t type, const char *data, uint64_t length)
+    {
+        FrameHeader header = {frame_magic, type, length};
+
+        // header and payload leave in one write where possible
+        iovec parts[2] = {{&header, sizeof(header)}, {const_cast<char *>(data), static_cast<size_t>(length)}};
+        msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = parts;
+        message.msg_iovlen = length > 0 ? 2 : 1;
+
+        while (message.msg_iovlen > 0)
+        {
+            ssize_t sent = sendmsg(fd, &message, MSG_NOSIGNAL);
+            if (sent < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                throw runtime_error(string("Connection lost: ") + strerror(errno));
+            }
+
+            // advance over the parts that were sent completely
+            while (message.msg_iovlen > 0 && static_cast<size_t>(sent) >= message.msg_iov->iov_len)
+            {
+                sent -= message.msg_iov->iov_len;
+                message.msg_iov++;
+                message.msg_iovlen--;
+            }
+            if (message.msg_iovlen > 0)
+            {
+                message.msg_iov->iov_base = static_cast<char *>(message.msg_iov->iov_base) + sent;
+                message.msg_iov->iov_len -= sent;
+            }
+        }
+    }
+
+    static bool receiveAll(int fd, char *data, size_t length, bool allowClose)
+    {
+        size_t received = 0;
+        while (received < length)
+        {
+            ssize_t count = recv(fd, data + received, length - received, 0);
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count == 0 && received == 0 && allowClose)
+                return false;
+            if (count <= 0)
+                throw runtime_error("Connection lost");
+            received += count;
+        }
+        return true;
+    }
+
+    bool FrameConnection::receive(FrameHeader& header, vector<char>& payload)
+    {
+        if (!receiveAll(fd, reinterpret_cast<char *>(&header), sizeof(header), true))
+            return false;
+        if (header.magic != frame_magic || header.length > 2 * frame_data_size + 4096)
+            throw runtime_error("Unsupported frame");
+
+        payload.resize(header.length);
+        receiveAll(fd, payload.data(), payload.size(), false);
+
+        if (header.type == frame_error)
+            throw runtime_error("Remote error: " + string(payload.begin(), payload.end()));
+        return true;
+    }
+
+    uint64_t FrameConnection::sendFile(string localFile, string remoteFile)
+    {
+        fstream file(localFile, fstream::in|fstream::binary);
+        if (!file.is_open())
+            throw runtime_error("Cannot read " + localFile);
+
+        send(frame_file_begin, remoteFile);
+
+        uint64_t bytes = 0;
+        vector<char> buffer(frame_data_size);
+        while (file)
+        {
+            file.read(buffer.data(), buffer.size());
+            if (file.gcount() > 0)
+                send(frame_file_data, buffer.data(), file.gcount());
+            bytes += file.gcount();
+        }
+
+        send(frame_file_end, "");
+        return bytes;
+    }
+
+    int FrameConnection::receiveFiles(string localDirectory)
+    {
+        FrameHeader header;
+        vector<char> payload;
+        fstream file;
+        string filename;
+        int files = 0;
+
+        while (receive(header, payload))
+        {
+            switch (header.type)
+            {
+                case frame_file_begin:
+                {
+                    string remoteFile(payload.begin(), payload.end());
+                    filename = localDirectory + remoteFile.substr(remoteFile.find_last_of('/') + 1);
+                    file.open(filename + ".part", fstream::out|fstream::trunc|fstream::binary);
+                    if (!file.is_open())
+                        throw runtime_error("Cannot write " + filename);
+                    break;
+                }
+                case frame_file_data:
+                    file.write(payload.data(), payload.size());
+                    break;
+                case frame_file_end:
+                    file.close();
+                    fs::rename(filename + ".part", filename);
+                    files++;
+                    break;
+                case frame_done:
+                    return files;
+                default:
+                    throw runtime_error("Unexpected frame " + to_string(header.type));
+            }
+        }
+        throw runtime_error("Connection closed during download");
+    }
+
+    Uploader::Uploader(string host, int port) : connection(FrameConnection::connectTo(host, port)), finished(false), bytes(0)
+    {
+        worker = thread(&Uploader::run, this);
+    }
+
+    Uploader::~Uploader()
+    {
+        if (worker.joinable())
+        {
+            {
+                lock_guard<std::mutex> lock(queueMutex);
+                finished = true;
+            }
+            queued.notify_all();
+            worker.join();
+        }
+    }
+
+    void Uploader::clear(string remoteDirectory)
+    {
+        {
+            lock_guard<std::mutex> lock(queueMutex);
+            queue.emplace_back(frame_clear, make_pair(string(), remoteDirectory));
+        }
+        queued.notify_all();
+    }
+
+    void Uploader::remove(string remoteFile)
+    {
+        {
+            lock_guard<std::mutex> lock(queueMutex);
+            queue.emplace_back(frame_remove, make_pair(string(), remoteFile));
+        }
+        queued.notify_all();
+    }
+
+    void Uploader::enqueue(string localFile, string remoteFile)
+    {
+        {
+            lock_guard<std::mutex> lock(queueMutex);
+            queue.emplace_back(frame_file_begin, make_pair(localFile, remoteFile));
+        }
+        queued.notify_all();
+    }
+
+    void Uploader::run()
+    {
+        while (true)
+        {
+            pair<uint32_t, pair<string, string>> next;
+            {
+                unique_lock<std::mutex> lock(queueMutex);
+                queued.wait(lock, [this] { return !queue.empty() || finished; });
+                if (queue.empty())
+                    return;
+                next = queue.front();
+                queue.pop_front();
+                if (!error.empty())
+                    continue;
+            }
+
+            try
+            {
+                if (next.first != frame_file_begin)
+                    connection->send(next.first, next.second.second);
+                else
+                {
+                    uint64_t sent = connection->sendFile(next.second.first, next.second.second);
+                    lock_guard<std::mutex> lock(queueMutex);
+                    bytes += sent;
+                }
+            }
+            catch (const exception& e)
+            {
+                lock_guard<std::mutex> lock(queueMutex);
+                error = e.what();
+            }
+        }
+    }
+
+    uint64_t Uploader::finish()
+    {
+        {
+            lock_guard<std::mutex> lock(queueMutex);
+            finished = true;
+        }
+        queued.notify_all();
+        worker.join();
+
+        if (!error.empty())
+            throw runtime_error(error);
+
+        // the server acknowledges once every file is renamed into place
+        FrameHeader header;
+        vector<char> payload;
+        connection->send(frame_done, "");
+        if (!connection->receive(header, payload) || header.type != frame_done)
+            throw runtime_error("Upload not acknowledged");
+        return bytes;
+    }
+
+    static string checkedDirectory(string directory, const vector<string>& directories)
+    {
+        if (find(directories.begin(), directories.end(), directory) == directories.end())
+            throw runtime_error("Directory not accessible: " + directory);
+        return directory;
+    }
+
+    static void handleTransfers(FrameConnection& connection, string dir_server, const vector<string>& directories)
+    {
+        FrameHeader header;
+        vector<char> payload;
+        fstream file;
+        string filename;
+
+        while (connection.receive(header, payload))
+        {
+            string text(payload.begin(), payload.end());
+            switch (header.type)
+            {
+                case frame_clear:
+                {
+                    string path = dir_server + checkedDirectory(text, directories);
+                    fs::create_directories(path);
+                    for (fs::directory_iterator it(path); it != fs::directory_iterator(); it++)
+                        if (fs::is_regular_file(it->path()))
+                            fs::remove(it->path());
+                    break;
+                }
+                case frame_file_begin:
+                {
+                    size_t split = text.find_last_of('/');
+                    string name = text.substr(split == string::npos ? 0 : split + 1);
+                    if (split == string::npos || name.empty() || name[0] == '.')
+                        throw runtime_error("Invalid file name: " + text);
+
+                    string path = dir_server + checkedDirectory(text.substr(0, split + 1), directories);
+                    fs::create_directories(path);
+                    filename = path + name;
+                    file.open(filename + ".part", fstream::out|fstream::trunc|fstream::binary);
+                    if (!file.is_open())
+                        throw runtime_error("Cannot write " + filename);
+                    break;
+                }
+                case frame_file_data:
+                    file.write(payload.data(), payload.size());
+                    break;
+                case frame_file_end:
+                    // readers such as the daemon only ever see complete files
+                    file.close();
+                    fs::rename(filename + ".part", filename);
+                    break;
+                case frame_remove:
+                {
+                    size_t split = text.find_last_of('/');
+                    string name = text.substr(split == string::npos ? 0 : split + 1);
+                    if (split == string::npos || name.empty() || name[0] == '.')
+                        throw runtime_error("Invalid file name: " + text);
+                    fs::remove(dir_server + checkedDirectory(text.substr(0, split + 1), directories) + name);
+                    break;
+                }
+                case frame_fetch:
+                {
+                    // a directory ends with '/', otherwise a single file is requested
+                    size_t split = text.find_last_of('/');
+                    string directory = checkedDirectory(text.substr(0, split + 1), directories);
+                    string name = text.substr(split + 1);
+                    if (!name.empty() && name[0] != '.' && fs::is_regular_file(dir_server + directory + name))
+                        connection.sendFile(dir_server + directory + name, directory + name);
+                    else if (name.empty() && fs::exists(dir_server + directory))
+                    {
+                        for (fs::directory_iterator it(dir_server + directory); it != fs::directory_iterator(); it++)
+                            if (fs::is_regular_file(it->path()) && it->path().extension() != ".part")
+                                connection.sendFile(it->path().string(), directory + it->path().filename().string());
+                    }
+                    connection.send(frame_done, "");
+                    break;
+                }
+                case frame_done:
+                    connection.send(frame_done, "");
+                    break;
+                default:
+                    throw runtime_error("Unexpected frame " + to_string(header.type));
+            }
+        }
+    }
+
+    void serveTransfers(string host, int port, string dir_server, vector<string> directories)
+    {
+        addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+
+        addrinfo *addresses = nullptr;
+        if (getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &addresses) != 0)
+            throw runtime_error("Cannot resolve " + host);
+
+        int listenFd = -1;
+        for (addrinfo *address = addresses; address != nullptr && listenFd < 0; address = address->ai_next)
+        {
+            listenFd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+            int flag = 1;
+            if (listenFd >= 0 && (setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag)) != 0 || ::bind(listenFd, address->ai_addr, address->ai_addrlen) != 0 || listen(listenFd, 4) != 0))
+            {
+                close(listenFd);
+                listenFd = -1;
+            }
+        }
+        freeaddrinfo(addresses);
+
+        if (listenFd < 0)
+            throw runtime_error("Cannot listen on " + host + ":" + to_string(port));
+
+        cout << "[SRV] Accepting transfers on " << host << ":" << port << ", the channel is not authenticated" << endl;
+
+        // one client at a time, uploads of the same directory must not interleave
+        while (true)
+        {
+            int socketFd = accept(listenFd, nullptr, nullptr);
+            if (socketFd < 0)
+                continue;
+
+            FrameConnection connection(socketFd);
+            try
+            {
+                handleTransfers(connection, dir_server, directories);
+            }
+            catch (const exception& e)
+            {
+                cout << "[SRV] Transfer failed: " << e.what() << endl;
+                try
+                {
+                    connection.send(frame_error, e.what());
+                }
+                catch (const exception&)
+                {
+                }
+            }
+        }
+    }
+
+    int uploadDirectory(string host, int port, string localDirectory, string remoteDirectory)
+    {
+        // the manifest goes last, so a polling server never sees it before the files it lists
+        vector<string> files;
+        for (fs::directory_iterator it(localDirectory); it != fs::directory_iterator(); it++)
+            if (fs::is_regular_file(it->path()) && it->path().filename() != manifest_file)
+                files.push_back(it->path().filename().string());
+        sort(files.begin(), files.end());
+        if (fs::exists(localDirectory + manifest_file))
+            files.push_back(manifest_file);
+
+        Uploader uploader(host, port);
+        uploader.clear(remoteDirectory);
+        for (const string& file : files)
+            uploader.enqueue(localDirectory + file, remoteDirectory + file);
+        uploader.finish();
+
+        return static_cast<int>(files.size());
+    }
+
+    int syncDirectory(string host, int port, string localDirectory, string remoteDirectory)
+    {
+        ManifestVersion local = readManifestVersion(localDirectory);
+
+        // the server's manifest is fetched into a scratch directory for comparison
+        fs::path scratch = fs::temp_directory_path() / fs::unique_path();
+        fs::create_directories(scratch);
+        {
+            unique_ptr<FrameConnection> connection = FrameConnection::connectTo(host, port);
+            connection->send(frame_fetch, remoteDirectory + manifest_file);
+            connection->receiveFiles(scratch.string() + "/");
+        }
+        ManifestVersion remote = readManifestVersion(scratch.string() + "/");
+        vector<ManifestEntry> remoteEntries = readManifest(scratch.string() + "/");
+        fs::remove_all(scratch);
+
+        if (local.lineage == 0 || local.lineage != remote.lineage)
+            return uploadDirectory(host, port, localDirectory, remoteDirectory);
+
+        map<string, uint64_t> remoteVersions;
+        for (const ManifestEntry& entry : remoteEntries)
+            remoteVersions[entry.name] = entry.version;
+
+        // the server never sees a manifest that lists containers still being replaced
+        Uploader uploader(host, port);
+        uploader.remove(remoteDirectory + manifest_file);
+
+        int files = 0;
+        set<string> listed;
+        for (const ManifestEntry& entry : readManifest(localDirectory))
+        {
+            listed.insert(entry.name);
+            auto remoteEntry = remoteVersions.find(entry.name);
+            if (remoteEntry == remoteVersions.end() || remoteEntry->second != entry.version)
+            {
+                uploader.enqueue(localDirectory + entry.name + ".enc", remoteDirectory + entry.name + ".enc");
+                files++;
+            }
+        }
+        for (const auto& remoteEntry : remoteVersions)
+            if (!listed.count(remoteEntry.first))
+                uploader.remove(remoteDirectory + remoteEntry.first + ".enc");
+
+        // files outside the manifest such as the column layout are small and always sent
+        for (fs::directory_iterator it(localDirectory); it != fs::directory_iterator(); it++)
+        {
+            string name = it->path().filename().string();
+            if (fs::is_regular_file(it->path()) && it->path().extension() != ".enc" && name != manifest_file)
+            {
+                uploader.enqueue(localDirectory + name, remoteDirectory + name);
+                files++;
+            }
+        }
+
+        uploader.enqueue(localDirectory + manifest_file, remoteDirectory + manifest_file);
+        uploader.finish();
+
+        return files + 1;
+    }
+
+    int downloadDirectory(string host, int port, string remoteDirectory, string localDirectory)
+    {
+        unique_ptr<FrameConnection> connection = FrameConnection::connectTo(host, port);
+        connection->send(frame_fetch, remoteDirectory);
+        return connection->receiveFiles(localDirectory);
+    }
+}
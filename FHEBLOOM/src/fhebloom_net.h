@@ -0,0 +1,118 @@
+// File       fhebloom_net.h
+// Brief      Length-prefixed TCP transfer channel header file of FHEBLOOM approach.
+// 
+// Copyright  BLOOM: Bloom filter based outsourced oblivious matchings
+//            Copyright (C) 2017 Communication and Distributed Systems (COMSYS), RWTH Aachen
+//            
+//            This program is free software: you can redistribute it and/or modify
+//            it under the terms of the GNU Affero General Public License as published
+//            by the Free Software Foundation, either version 3 of the License, or
+//            (at your option) any later version.
+//            
+//            This program is distributed in the hope that it will be useful,
+//            but WITHOUT ANY WARRANTY; without even the implied warranty of
+//            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//            GNU Affero General Public License for more details.
+//            You should have received a copy of the GNU Affero General Public License
+//            along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FHEBLOOM_NET_H
+#define FHEBLOOM_NET_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace bloomLib
+{
+    const static uint32_t frame_magic = 0x464e4246;           // "FBNF"
+    const static int default_transfer_port = 7766;
+    const static size_t frame_data_size = 1 << 20;             // file data is split into frames of at most 1 MiB
+
+    enum FrameType : uint32_t
+    {
+        frame_clear = 1,        // payload: server directory, removes all files in it (rsync --delete)
+        frame_file_begin = 2,   // payload: server directory + file name
+        frame_file_data = 3,    // payload: next bytes of the current file
+        frame_file_end = 4,     // the current file is complete and renamed into place
+        frame_fetch = 5,        // payload: server directory or file, answered with its files and frame_done
+        frame_done = 6,
+        frame_error = 7,        // payload: error message
+        frame_remove = 8        // payload: server directory + file name
+    };
+
+    // Every frame starts with this header, followed by length bytes of payload
+    struct FrameHeader
+    {
+        uint32_t magic;
+        uint32_t type;
+        uint64_t length;
+    };
+
+    class FrameConnection
+    {
+    public:
+        explicit FrameConnection(int socketFd);
+        ~FrameConnection();
+        FrameConnection(const FrameConnection&) = delete;
+        FrameConnection& operator=(const FrameConnection&) = delete;
+
+        static std::unique_ptr<FrameConnection> connectTo(std::string host, int port);
+
+        void send(uint32_t type, const char *data, uint64_t length);
+        void send(uint32_t type, const std::string& payload) { send(type, payload.data(), payload.size()); }
+        // false if the peer closed the connection between frames
+        bool receive(FrameHeader& header, std::vector<char>& payload);
+
+        // remoteFile is "<server directory><file name>"
+        uint64_t sendFile(std::string localFile, std::string remoteFile);
+        // stores the files sent until frame_done into localDirectory, returns their number
+        int receiveFiles(std::string localDirectory);
+
+    private:
+        int fd;
+    };
+
+    // Sends files in the background while the caller keeps encrypting, in the order they are queued
+    class Uploader
+    {
+    public:
+        Uploader(std::string host, int port);
+        ~Uploader();
+
+        void clear(std::string remoteDirectory);
+        void remove(std::string remoteFile);
+        void enqueue(std::string localFile, std::string remoteFile);
+        // waits until all queued files are sent, returns the number of bytes sent
+        uint64_t finish();
+
+    private:
+        void run();
+
+        std::unique_ptr<FrameConnection> connection;
+        std::mutex queueMutex;
+        std::condition_variable queued;
+        std::deque<std::pair<uint32_t, std::pair<std::string, std::string>>> queue;   // frame type, local file, remote file
+        bool finished;
+        uint64_t bytes;
+        std::string error;
+        std::thread worker;
+    };
+
+    // Accepts uploads and fetches into the server processing directory until the process ends,
+    // only the given subdirectories of dir_server can be written or read. The channel is neither
+    // authenticated nor encrypted, host should be a loopback or private address reached through a tunnel
+    void serveTransfers(std::string host, int port, std::string dir_server, std::vector<std::string> directories);
+
+    int uploadDirectory(std::string host, int port, std::string localDirectory, std::string remoteDirectory);
+    // only sends the containers that changed since the server's manifest if both have the same lineage
+    int syncDirectory(std::string host, int port, std::string localDirectory, std::string remoteDirectory);
+    int downloadDirectory(std::string host, int port, std::string remoteDirectory, std::string localDirectory);
+}
+
+#endif //FHEBLOOM_NET_H
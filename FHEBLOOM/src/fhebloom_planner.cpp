@@ -0,0 +1,260 @@
+// File       fhebloom_planner.cpp
+// Brief      HElib parameter planner class file of FHEBLOOM approach.
+// 
+// Copyright  BLOOM: Bloom filter based outsourced oblivious matchings
+//            Copyright (C) 2017 Communication and Distributed Systems (COMSYS), RWTH Aachen
+//            
+//            This program is free software: you can redistribute it and/or modify
+//            it under the terms of the GNU Affero General Public License as published
+//            by the Free Software Foundation, either version 3 of the License, or
+//            (at your option) any later version.
+//            
+//            This program is distributed in the hope that it will be useful,
+//            but WITHOUT ANY WARRANTY; without even the implied warranty of
+//            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//            GNU Affero General Public License for more details.
+//            You should have received a copy of the GNU Affero General Public License
+//            along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#include <EncryptedArray.h>
+#include <FHE.h>
+#include <replicate.h>
+#include <chrono>
+#include <random>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include "fhebloom_planner.h"
+#include "fhebloom_vcf.h"
+
+using namespace std;
+
+namespace bloomLib
+{
+    // the planner gives up if the circuit does not decrypt correctly with this many levels
+    const static long planner_max_levels = 16;
+
+    long maxMatchCount(const PlannerInput& input)
+    {
+        // a patient matches at most the bits set in the query
+        BloomParameters bloom = bloomParameters(input.snps, input.errorRate);
+        return min(bloom.numberBits(), bloom.hashes * input.snps);
+    }
+
+    // Ciphertexts of the cohort plus one query and the products the server computes with them
+    static void countChunks(const PlannerInput& input, long bits, long nslots, long& chunks, long& products)
+    {
+        long queryChunks = (bits + nslots - 1) / nslots;
+        if (input.columnLayout)
+            products = (input.patients + nslots - 1) / nslots * bits;
+        else
+            products = input.patients * queryChunks;
+        chunks = products + queryChunks;
+    }
+
+    // Multiplies every replica of a query chunk with one database column and sums the products, as ColumnAccumulator does
+    class ColumnProducts : public ReplicateHandler
+    {
+    public:
+        explicit ColumnProducts(const Ctxt& ctColumn) : ctSum(ctColumn.getPubKey()), replicas(0), column(ctColumn) {}
+
+        void handle(const Ctxt& ctReplica) override
+        {
+            Ctxt ctProduct = ctReplica;
+            ctProduct.multLowLvl(column);
+            if (replicas++ == 0)
+                ctSum = ctProduct;
+            else
+                ctSum += ctProduct;
+        }
+
+        Ctxt ctSum;
+        long replicas;
+
+    private:
+        const Ctxt& column;
+    };
+
+    static double secondsSince(chrono::steady_clock::time_point start)
+    {
+        return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+
+    // Generates keys for (m, p, L) and runs the matching circuit of one patient on random Bloom chunks:
+    // lazy products summed as often as a patient has chunks, relinearization, totalSums and the packing mask.
+    // The column layout instead multiplies the replicas of a query chunk with database columns and needs no
+    // totalSums. Returns whether the counts decrypt correctly, timings and sizes are filled in either way.
+    static bool evaluate(const PlannerInput& input, long bits, KeyParameters& result)
+    {
+        FHEcontext context(result.m, result.p, result.r);
+        buildModChain(context, result.L, input.c);
+        FHESecKey secretKey(context);
+        const FHEPubKey& publicKey = secretKey;
+        secretKey.GenSecKey(input.w);
+        addSome1DMatrices(secretKey);
+
+        ZZX G = context.alMod.getFactorsOverZZ()[0];
+        EncryptedArray ea(context, G);
+        result.nslots = ea.size();
+
+        long products;
+        countChunks(input, bits, result.nslots, result.chunks, products);
+
+        mt19937 generator(static_cast<unsigned>(result.m));
+        vector<long> dbBits(result.nslots), qryBits(result.nslots);
+        long matches = 0, querySet = 0;
+        for (long i = 0; i < result.nslots; i++)
+        {
+            dbBits.at(i) = generator() & 1;
+            qryBits.at(i) = generator() & 1;
+            matches += dbBits.at(i) * qryBits.at(i);
+            querySet += qryBits.at(i);
+        }
+
+        Ctxt ctDb(publicKey), ctQry(publicKey);
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < input.repetitions; i++)
+        {
+            ea.encrypt(ctDb, publicKey, dbBits);
+            ea.encrypt(ctQry, publicKey, qryBits);
+        }
+        result.encryptSeconds = secondsSince(start) / (2 * input.repetitions);
+
+        ostringstream serialized;
+        ctDb.write(serialized);
+        result.bytes = serialized.str().size();
+
+        // same operations as accumulateChunks and ColumnAccumulator in lazy mode, both get base level chunks
+        ctDb.modDownToLevel(ctDb.findBaseLevel());
+        ctQry.modDownToLevel(ctQry.findBaseLevel());
+        Ctxt ctSum(publicKey);
+        long copies;
+        start = chrono::steady_clock::now();
+        if (input.columnLayout)
+        {
+            // one replicateAll yields a product for each of the nslots Bloom positions of the query chunk
+            ColumnProducts columnProducts(ctDb);
+            replicateAll(ea, ctQry, &columnProducts);
+            ctSum = columnProducts.ctSum;
+            copies = columnProducts.replicas;
+        }
+        else
+        {
+            for (int i = 0; i < input.repetitions; i++)
+            {
+                Ctxt ctProduct = ctQry;
+                ctProduct.multLowLvl(ctDb);
+                if (i == 0)
+                    ctSum = ctProduct;
+                else
+                    ctSum += ctProduct;
+            }
+            copies = input.repetitions;
+        }
+        result.multiplySeconds = secondsSince(start) / copies;
+        result.cost = result.chunks * result.encryptSeconds + products * result.multiplySeconds;
+
+        // a result sums one product per query chunk (per Bloom position in column layout),
+        // doubling the sum reaches that noise without computing them all
+        long summands = input.columnLayout ? bits : (bits + result.nslots - 1) / result.nslots;
+        long factor = 1;
+        for (; copies < summands; copies *= 2, factor *= 2)
+        {
+            Ctxt ctCopy = ctSum;
+            ctSum += ctCopy;
+        }
+        ctSum.reLinearize();
+        ctSum.modDownToLevel(ctSum.findBaseLevel());
+
+        vector<long> decrypted;
+        if (input.columnLayout)
+        {
+            // slot j holds the set query bits times the database bit of patient j
+            ea.decrypt(ctSum, secretKey, decrypted);
+            result.correct = true;
+            for (long i = 0; i < result.nslots; i++)
+                result.correct &= decrypted.at(i) == (factor % result.p) * (querySet * dbBits.at(i) % result.p) % result.p;
+            return result.correct;
+        }
+
+        totalSums(ea, ctSum);
+        ZZX mask;
+        ea.encodeUnitSelector(mask, 0);
+        ctSum.multByConstant(mask);
+
+        ea.decrypt(ctSum, secretKey, decrypted);
+        long expected = (copies % result.p) * (matches % result.p) % result.p;
+        result.correct = decrypted.at(0) == expected;
+        for (long i = 1; i < result.nslots; i++)
+            result.correct &= decrypted.at(i) == 0;
+        return result.correct;
+    }
+
+    static void printCandidate(string name, const KeyParameters& candidate)
+    {
+        cout << name << "   m=" << candidate.m << " p=" << candidate.p << " L=" << candidate.L << " nslots=" << candidate.nslots
+             << " chunks=" << candidate.chunks << " encrypt=" << candidate.encryptSeconds * 1000 << "ms multiply=" << candidate.multiplySeconds * 1000
+             << "ms size=" << candidate.bytes << "B cost=" << candidate.cost << "s" << (candidate.correct ? "" : " [decryption failed]") << endl;
+    }
+
+    KeyParameters planParameters(string name, const PlannerInput& input, vector<KeyParameters> *candidates)
+    {
+        long bits = bloomParameters(input.snps, input.errorRate).numberBits();
+        long maxCount = maxMatchCount(input);
+
+        KeyParameters base;
+        base.p = NextPrime(maxCount + 1);
+        cout << name << " Bloom filter of " << bits << " bits, match counts up to " << maxCount << ", plaintext modulus " << base.p << endl;
+
+        // the smallest modulus chain on which the circuit decrypts correctly, probed with the smallest m
+        for (long levels = 2; levels <= planner_max_levels && !base.L; levels++)
+        {
+            KeyParameters probe = base;
+            probe.L = levels;
+            probe.m = FindM(input.security, probe.L, input.c, probe.p, 0, 0, 0);
+            if (evaluate(input, bits, probe))
+                base.L = levels;
+            printCandidate(name, probe);
+        }
+        if (!base.L)
+            throw runtime_error("No modulus chain with up to " + to_string(planner_max_levels) + " levels decrypts correctly");
+        cout << name << " Levels for one multiplication: " << base.L << endl;
+
+        // candidate cyclotomics: the smallest m for a growing minimum number of slots, up to one chunk per Bloom filter
+        set<long> cyclotomics;
+        for (long slots = 0; ; slots = slots ? 2 * slots : 256)
+        {
+            try
+            {
+                cyclotomics.insert(FindM(input.security, base.L, input.c, base.p, 0, slots, 0));
+            }
+            catch (...)
+            {
+                break;
+            }
+            if (slots >= bits)
+                break;
+        }
+
+        KeyParameters plan;
+        for (long m : cyclotomics)
+        {
+            KeyParameters candidate = base;
+            candidate.m = m;
+            // a larger ring may need one level more
+            if (!evaluate(input, bits, candidate))
+            {
+                candidate.L++;
+                evaluate(input, bits, candidate);
+            }
+            printCandidate(name, candidate);
+            if (candidates)
+                candidates->push_back(candidate);
+            if (candidate.correct && (!plan.correct || candidate.cost < plan.cost))
+                plan = candidate;
+        }
+        if (!plan.correct)
+            throw runtime_error("No cyclotomic m decrypts correctly");
+        return plan;
+    }
+}
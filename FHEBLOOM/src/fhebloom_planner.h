@@ -0,0 +1,64 @@
+// File       fhebloom_planner.h
+// Brief      HElib parameter planner header file of FHEBLOOM approach.
+// 
+// Copyright  BLOOM: Bloom filter based outsourced oblivious matchings
+//            Copyright (C) 2017 Communication and Distributed Systems (COMSYS), RWTH Aachen
+//            
+//            This program is free software: you can redistribute it and/or modify
+//            it under the terms of the GNU Affero General Public License as published
+//            by the Free Software Foundation, either version 3 of the License, or
+//            (at your option) any later version.
+//            
+//            This program is distributed in the hope that it will be useful,
+//            but WITHOUT ANY WARRANTY; without even the implied warranty of
+//            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//            GNU Affero General Public License for more details.
+//            You should have received a copy of the GNU Affero General Public License
+//            along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FHEBLOOM_PLANNER_H
+#define FHEBLOOM_PLANNER_H
+
+#include <string>
+#include <vector>
+
+namespace bloomLib
+{
+    // What the keys have to support: the Bloom filters of a cohort and the security level
+    struct PlannerInput
+    {
+        long snps;                  // SNPs m per patient and per query
+        double errorRate;           // false positive probability q
+        long patients;              // cohort size n
+        long security;              // target security bits
+        bool columnLayout = false;  // database in column layout, see --layout
+        long c = 2;                 // columns of the key switching matrices
+        long w = 64;                // Hamming weight of the secret key
+        int repetitions = 3;        // timed repetitions per candidate
+    };
+
+    // One benchmarked candidate, the plan is the candidate with the lowest cost
+    struct KeyParameters
+    {
+        long m = 0;                 // cyclotomic index
+        long p = 0;                 // plaintext modulus
+        long r = 1;
+        long L = 0;                 // levels of the modulus chain
+        long nslots = 0;
+        long chunks = 0;            // ciphertexts of the whole cohort and one query
+        double encryptSeconds = 0;  // per chunk on the client
+        double multiplySeconds = 0; // per product on the server, with its share of replicateAll in column layout
+        size_t bytes = 0;           // per chunk
+        double cost = 0;            // estimated seconds to encrypt and match the cohort
+        bool correct = false;       // the matching circuit decrypted correctly
+    };
+
+    // Largest match count of a patient, a plaintext modulus above it cannot overflow
+    long maxMatchCount(const PlannerInput& input);
+
+    // Smallest prime above maxMatchCount, minimal modulus chain for one multiplication
+    // and the cyclotomic m with the lowest chunks times ciphertext cost
+    KeyParameters planParameters(std::string name, const PlannerInput& input, std::vector<KeyParameters> *candidates = nullptr);
+}
+
+#endif //FHEBLOOM_PLANNER_H
@@ -24,13 +24,112 @@
 #include <boost/filesystem.hpp>
 #include <boost/program_options.hpp>
 #include <boost/thread.hpp>
+#include <chrono>
+#include <omp.h>
+#include <thread>
 #include "fhebloom_config.h"
+#include "fhebloom_metrics.h"
+#include "fhebloom_net.h"
+#include "fhebloom_shard.h"
 
 using namespace std;
 namespace po = boost::program_options;
 namespace fs = boost::filesystem;
 namespace bl = bloomLib;
 
+// Coordinator of a sharded server: partitions the database across worker servers, fans out the queries and merges the results,
+// the workers load the keys and the shard from disk for every query
+void coordinate(const po::variables_map& vm, string server)
+{
+    string dir_server = vm["dir_server"].as<string>();
+
+    bl::ShardOptions shardOptions;
+    shardOptions.shards = vm["shards"].as<int>();
+    shardOptions.server = server;
+    // local workers share the threads and the memory limit of this machine, remote ones get the full values
+    size_t memoryLimit = vm["memory_limit"].as<size_t>();
+    if (vm.count("shard_command"))
+        shardOptions.command = vm["shard_command"].as<string>();
+    else
+    {
+        shardOptions.threads = max(1, omp_get_max_threads() / shardOptions.shards);
+        if (memoryLimit > 0)
+            memoryLimit = max<size_t>(1, memoryLimit / shardOptions.shards);
+    }
+    for (string flag : {"eager_relin", "unpacked_results", "untrimmed_results", "compress"})
+        if (vm.count(flag))
+            shardOptions.arguments.push_back("--" + flag);
+    shardOptions.arguments.insert(shardOptions.arguments.end(), {"--tasks_per_patient", to_string(vm["tasks_per_patient"].as<int>()),
+                                                                 "--memory_limit", to_string(memoryLimit),
+                                                                 "--readahead", to_string(vm["readahead"].as<int>())});
+    if (vm.count("metrics"))
+        shardOptions.metrics = vm["metrics"].as<string>();
+
+    if (!vm.count("daemon"))
+    {
+        cout << "[SRV] ## Starting Computation on " << shardOptions.shards << " shards!" << endl;
+
+        bl::ShardPlan plan = bl::partitionDatabase("[SRV]", dir_server, shardOptions.shards);
+        bl::fanOutQueries(dir_server, shardOptions.shards);
+        bl::runShards("[SRV]", dir_server, shardOptions);
+        bl::mergeResults("[SRV]", dir_server, plan);
+
+        cout << "[SRV] ## Finished Computation!" << endl;
+        return;
+    }
+
+    cout << "[SRV] Coordinator up and running, waiting for uploads" << endl;
+
+    bl::ShardPlan plan;
+    size_t dbLoaded = 0, dbPending = 0, dbFailed = 0;
+    size_t qryAnswered = 0, qryPending = 0;
+
+    while (true)
+    {
+        size_t dbStamp = bl::manifestStamp(dir_server + bl::dir_server_db);
+        if (dbStamp != dbPending)
+            dbPending = dbStamp;
+        else if (dbStamp != dbLoaded && dbStamp != dbFailed && dbStamp != 0)
+        {
+            cout << "[SRV] ## Partitioning Database!" << endl;
+            dbLoaded = dbStamp;
+            qryAnswered = 0;
+            try
+            {
+                plan = bl::partitionDatabase("[SRV]", dir_server, shardOptions.shards);
+            }
+            catch (const exception& e)
+            {
+                cout << "[SRV] " << e.what() << endl;
+                dbLoaded = 0;
+                dbFailed = dbStamp;
+            }
+        }
+
+        size_t qryStamp = bl::manifestStamp(dir_server + bl::dir_server_qry);
+        if (qryStamp != qryPending)
+            qryPending = qryStamp;
+        else if (qryStamp != qryAnswered && qryStamp != 0 && dbLoaded != 0)
+        {
+            cout << "[SRV] ## Starting Computation on " << shardOptions.shards << " shards!" << endl;
+            qryAnswered = qryStamp;
+            try
+            {
+                bl::fanOutQueries(dir_server, shardOptions.shards);
+                bl::runShards("[SRV]", dir_server, shardOptions);
+                bl::mergeResults("[SRV]", dir_server, plan);
+                cout << "[SRV] ## Finished Computation!" << endl;
+            }
+            catch (const exception& e)
+            {
+                cout << "[SRV] " << e.what() << endl;
+            }
+        }
+
+        this_thread::sleep_for(chrono::seconds(vm["poll"].as<int>()));
+    }
+}
+
 int main(int argc, char* argv[])
 {
 
@@ -38,8 +137,26 @@ int main(int argc, char* argv[])
     desc.add_options()
             ("help", "produce help message")
             ("run", "start server")
+            ("daemon", "keep the encrypted database in memory and answer every new query [use with --run]")
+            ("poll", po::value<int>()->default_value(1), "Interval in seconds to check for new uploads in daemon mode [default: 1]")
+            ("eager_relin", "relinearize every product instead of once per patient")
+            ("unpacked_results", "store one result ciphertext per patient instead of packing all counts")
+            ("untrimmed_results", "store results at the level the computation ended instead of mod-switching them to the fewest primes that decrypt")
+            ("compress", "store the results compressed, a modest saving of about 14% of the bytes to download")
+            ("tasks_per_patient", po::value<int>()->default_value(0), "number of chunk ranges matched in parallel per patient, 0 uses twice the thread count")
+            ("memory_limit", po::value<size_t>()->default_value(0), "Memory in MB for resident and in-flight ciphertexts, patients are throttled and streamed from disk to stay below, with --shards it is split across local workers and applies to each --shard_command worker, 0: unlimited [default: 0]")
+            ("readahead", po::value<int>()->default_value(4), "Chunks of streamed patients whose file pages the kernel reads ahead of the computation, they are still deserialized when used, 0: off [default: 4]")
+
+            ("shards", po::value<int>(), "Coordinate this many worker servers, each runs on its part of the database in <dir_server>fhebloom_server_shard_<i>/, the results are merged [use with --run]")
+            ("shard_command", po::value<string>(), "Start the workers with this shell command instead of locally, {shard} is the shard number, e.g. \"ssh node{shard} fhebloom_server\" [needs dir_server on shared storage]")
+
+            ("listen", po::value<int>()->implicit_value(bl::default_transfer_port), "Accept uploads and result downloads from fhebloom_client --transport tcp on this port, the channel is not authenticated [default: 7766]")
+            ("listen_address", po::value<string>()->default_value("127.0.0.1"), "Address --listen binds to, anyone reaching it can replace the database and fetch results, so tunnel remote clients (e.g. ssh -L) [default: 127.0.0.1]")
 
             ("dir_server", po::value<string>()->default_value("/tmp/"), "Path to the server processing directory [default: /tmp/]")
+
+            ("metrics", po::value<string>(), "Write step timings and the noise budget of the results as <prefix>.json and Prometheus text <prefix>.prom after every computation")
+            ("metrics_interval", po::value<int>()->default_value(0), "Also rewrite the metrics files every this many seconds in daemon mode, 0: only after computations [default: 0]")
             ;
 
     po::variables_map vm;
@@ -53,48 +170,186 @@ int main(int argc, char* argv[])
         return 1;
     }
 
+    thread transfers;
+    if (vm.count("listen"))
+    {
+        // transfers are served in the background, the public key may still be on its way
+        transfers = thread([&vm]()
+        {
+            try
+            {
+                bl::serveTransfers(vm["listen_address"].as<string>(), vm["listen"].as<int>(), vm["dir_server"].as<string>(), {bl::dir_server_db, bl::dir_server_pubKey, bl::dir_server_qry, bl::dir_server_res});
+            }
+            catch (const exception& e)
+            {
+                cout << "[SRV] " << e.what() << endl;
+                exit(-1);
+            }
+        });
+
+        while (!(fs::exists(vm["dir_server"].as<string>() + string(bl::dir_server_pubKey) + "helib_context.key") && fs::exists(vm["dir_server"].as<string>() + string(bl::dir_server_pubKey) + "helib_public.key")))
+            this_thread::sleep_for(chrono::seconds(vm["poll"].as<int>()));
+    }
+
     if(!(fs::exists(vm["dir_server"].as<string>() + string(bl::dir_server_pubKey) + "helib_context.key") || fs::exists(vm["dir_server"].as<string>() + string(bl::dir_server_pubKey) + "helib_public.key")))
     {
         cout << "[SRV] No key files found, please upload public key" << endl;
         return -1;
     }
 
-    fstream contextFile(vm["dir_server"].as<string>() + string(bl::dir_server_pubKey) + "helib_context.key", fstream::in);
-    // Read context from file
-    unsigned long m1, p1, r1;
-    vector<long> gens, ords;
-    readContextBase(contextFile, m1, p1, r1, gens, ords);
-    FHEcontext context(m1, p1, r1, gens, ords);
-    contextFile >> context;
+    // the coordinator only links containers, its workers load the keys
+    if (vm.count("shards") && vm.count("run"))
+    {
+        if (vm["shards"].as<int>() < 1)
+        {
+            cout << "[SRV] At least one shard is needed" << endl;
+            return -1;
+        }
 
-    fstream publicFile(vm["dir_server"].as<string>() + string(bl::dir_server_pubKey) + "helib_public.key", fstream::in);
-    FHEPubKey publicKey(context);
-    publicFile >> publicKey;
+        try
+        {
+            coordinate(vm, argv[0]);
+        }
+        catch (const exception& e)
+        {
+            cout << "[SRV] " << e.what() << endl;
+            return -1;
+        }
 
-    ZZX G = context.alMod.getFactorsOverZZ()[0];
-    EncryptedArray ea(context, G);
+        // keep serving so the client can download the results
+        if (transfers.joinable())
+            transfers.join();
+        return 0;
+    }
 
-    int numberFiles = 0; // n
-    int numberChunks = 0;
+    bl::KeyMaterial keys;
+    bl::loadKeys("[SRV]", vm["dir_server"].as<string>() + string(bl::dir_server_pubKey) + "helib_context.key",
+                 vm["dir_server"].as<string>() + string(bl::dir_server_pubKey) + "helib_public.key",
+                 vm["dir_server"].as<string>() + string(bl::dir_server_pubKey) + bl::public_snapshot_file, false, keys);
+    const FHEPubKey &publicKey = keys.pubKey();
+    EncryptedArray &ea = *keys.ea;
 
     if (!vm.count("run"))
     {
         cout << "[SRV] No launch specified" << endl;
+        if (transfers.joinable())
+            transfers.join();
+        return 0;
+    }
+
+    string database_path = vm["dir_server"].as<string>() + bl::dir_server_db;
+    string query_path = vm["dir_server"].as<string>() + bl::dir_server_qry;
+    string result_path = vm["dir_server"].as<string>() + bl::dir_server_res;
+
+    bl::ExecuteOptions options;
+    options.lazyRelinearization = !vm.count("eager_relin");
+    options.packResults = !vm.count("unpacked_results");
+    options.trimResults = !vm.count("untrimmed_results");
+    options.compressResults = vm.count("compress");
+    options.tasksPerPatient = vm["tasks_per_patient"].as<int>();
+    options.memoryLimit = vm["memory_limit"].as<size_t>() << 20;
+    options.readaheadChunks = vm["readahead"].as<int>();
+    options.minimumLevel = bl::multiplicationLevel(publicKey);
+    cout << "[SRV] Ciphertexts need at least " << options.minimumLevel << " primes" << endl;
+
+    if (!vm.count("daemon"))
+    {
+        cout << "[SRV] Server up and running" << endl;
+
+        cout << "[SRV] ## Starting Computation!" << endl;
+
+        bl::execute("[SRV]", database_path, query_path, result_path, publicKey, ea, options);
+
+        cout << "[SRV] ## Finished Computation!" << endl;
+
+        if (vm.count("metrics"))
+            bl::writeMetrics(vm["metrics"].as<string>());
+
+        // keep serving so the client can download the results
+        if (transfers.joinable())
+            transfers.join();
         return 0;
     }
 
     /*
      * Step 1: Wait for new Database Upload or Query
+     *          uploads are only picked up once all containers listed in the manifest are complete
+     *          and did not change for one poll interval
      *
      */
 
-    cout << "[SRV] Server up and running" << endl;
+    cout << "[SRV] Server up and running, waiting for uploads" << endl;
+
+    Ctxt ctEmpty(publicKey);
+    vector<bl::DatabaseEntry> database;
+    size_t dbLoaded = 0, dbPending = 0, dbFailed = 0;
+    size_t qryAnswered = 0, qryPending = 0, qryFailed = 0;
+    auto metricsWritten = chrono::steady_clock::now();
 
-    cout << "[SRV] ## Starting Computation!" << endl;
+    while (true)
+    {
+        size_t dbStamp = bl::manifestStamp(database_path);
+        if (dbStamp != dbPending)
+            dbPending = dbStamp;
+        else if (dbStamp != dbLoaded && dbStamp != dbFailed && dbStamp != 0)
+        {
+            cout << "[SRV] ## Loading Database!" << endl;
+            // a broken upload is skipped until its manifest changes, the previous database stays resident
+            try
+            {
+                Ctxt ctLoadedEmpty = bl::loadCtChunk(0, publicKey, database_path + "emptyvector");
+                vector<bl::DatabaseEntry> loaded;
+                bl::loadDatabase("[SRV]", database_path, publicKey, loaded, options);
+                ctEmpty = ctLoadedEmpty;
+                database.swap(loaded);
+                dbLoaded = dbStamp;
+                // the resident database changed, answer the current query again
+                qryAnswered = 0;
+                qryFailed = 0;
+            }
+            catch (const exception& e)
+            {
+                cout << "[SRV] " << e.what() << endl;
+                dbFailed = dbStamp;
+            }
+        }
 
-    bl::execute("[SRV]", vm["dir_server"].as<string>() + bl::dir_server_db, vm["dir_server"].as<string>() + bl::dir_server_qry, vm["dir_server"].as<string>() + bl::dir_server_res, publicKey, ea);
+        size_t qryStamp = bl::manifestStamp(query_path);
+        if (qryStamp != qryPending)
+            qryPending = qryStamp;
+        else if (qryStamp != qryAnswered && qryStamp != qryFailed && qryStamp != 0 && dbLoaded != 0)
+        {
+            cout << "[SRV] ## Starting Computation!" << endl;
 
-    cout << "[SRV] ## Finished Computation!" << endl;
+            try
+            {
+                bl::execute("[SRV]", database_path, database, ctEmpty, query_path, result_path, publicKey, ea, options);
+
+                cout << "[SRV] ## Finished Computation!" << endl;
+                qryAnswered = qryStamp;
+
+                if (vm.count("metrics"))
+                {
+                    bl::writeMetrics(vm["metrics"].as<string>());
+                    metricsWritten = chrono::steady_clock::now();
+                }
+            }
+            catch (const exception& e)
+            {
+                cout << "[SRV] " << e.what() << endl;
+                qryFailed = qryStamp;
+            }
+        }
+
+        // long running servers can be scraped between computations
+        if (vm.count("metrics") && vm["metrics_interval"].as<int>() > 0 && chrono::steady_clock::now() - metricsWritten >= chrono::seconds(vm["metrics_interval"].as<int>()))
+        {
+            bl::writeMetrics(vm["metrics"].as<string>());
+            metricsWritten = chrono::steady_clock::now();
+        }
+
+        this_thread::sleep_for(chrono::seconds(vm["poll"].as<int>()));
+    }
 
     return 0;
 }
@@ -0,0 +1,283 @@
+// File       fhebloom_shard.cpp
+// Brief      Sharded server coordinator class file of FHEBLOOM approach.
+// 
+// Copyright  BLOOM: Bloom filter based outsourced oblivious matchings
+//            Copyright (C) 2017 Communication and Distributed Systems (COMSYS), RWTH Aachen
+//            
+//            This program is free software: you can redistribute it and/or modify
+//            it under the terms of the GNU Affero General Public License as published
+//            by the Free Software Foundation, either version 3 of the License, or
+//            (at your option) any later version.
+//            
+//            This program is distributed in the hope that it will be useful,
+//            but WITHOUT ANY WARRANTY; without even the implied warranty of
+//            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//            GNU Affero General Public License for more details.
+//            You should have received a copy of the GNU Affero General Public License
+//            along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#include <boost/algorithm/string.hpp>
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <fcntl.h>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <set>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "fhebloom_config.h"
+#include "fhebloom_shard.h"
+
+namespace fs = boost::filesystem;
+
+namespace bloomLib
+{
+    string shardPath(string dir_server, int shard)
+    {
+        return dir_server + dir_server_shard + to_string(shard) + "/";
+    }
+
+    static void resetDirectory(string path)
+    {
+        if (fs::exists(path))
+            fs::remove_all(path);
+        fs::create_directories(path);
+    }
+
+    // Shards share the containers of the coordinator, copies are only made across file systems
+    static void linkFile(string from, string to)
+    {
+        boost::system::error_code error;
+        fs::create_hard_link(from, to, error);
+        if (error)
+            fs::copy_file(from, to);
+    }
+
+    ShardPlan partitionDatabase(string name, string dir_server, int shards)
+    {
+        string database_path = dir_server + dir_server_db;
+
+        map<string, ManifestEntry> containers;
+        for (const ManifestEntry& entry : readManifest(database_path))
+            containers[entry.name] = entry;
+        if (!containers.count("emptyvector"))
+            throw runtime_error("No empty vector in " + database_path);
+
+        // packed results hold nslots patients per chunk
+        uint32_t nslots = CtxtContainer(database_path + "emptyvector.enc").header(0).slots;
+
+        // a unit goes to one shard: a column layout group or a block of nslots row layout patients,
+        // the blocks of one Bloom filter size are created in the order of packedPatients
+        struct Unit
+        {
+            vector<string> names;
+            uint64_t bytes;
+            bool rowLayout;
+            string currentBloom;
+        };
+        vector<Unit> units;
+        map<string, size_t> filling;
+        for (const DatabaseEntry& entry : enumerateDatabase(database_path))
+        {
+            if (entry.columnLayout)
+            {
+                units.push_back(Unit{{entry.prefix}, containers.at(entry.prefix).bytes, false, entry.currentBloom});
+                continue;
+            }
+
+            if (!filling.count(entry.currentBloom) || units.at(filling.at(entry.currentBloom)).names.size() == nslots)
+            {
+                filling[entry.currentBloom] = units.size();
+                units.push_back(Unit{{}, 0, true, entry.currentBloom});
+            }
+            Unit& unit = units.at(filling.at(entry.currentBloom));
+            unit.names.push_back(entry.prefix);
+            unit.bytes += containers.at(entry.prefix).bytes;
+        }
+
+        // largest units first, each to the shard with the fewest bytes so far
+        vector<size_t> order(units.size());
+        iota(order.begin(), order.end(), 0);
+        stable_sort(order.begin(), order.end(), [&units](size_t a, size_t b) { return units.at(a).bytes > units.at(b).bytes; });
+
+        vector<uint64_t> load(shards, 0);
+        vector<int> assigned(units.size());
+        for (size_t u : order)
+        {
+            assigned.at(u) = static_cast<int>(min_element(load.begin(), load.end()) - load.begin());
+            load.at(assigned.at(u)) += units.at(u).bytes;
+        }
+
+        // within a shard the blocks of one Bloom filter size keep their order, so its k-th packed chunk is the k-th assigned block
+        ShardPlan plan;
+        plan.entries.assign(shards, vector<ManifestEntry>(1, containers.at("emptyvector")));
+        map<pair<string, int>, uint32_t> shardChunks;
+        for (size_t u = 0; u < units.size(); u++)
+        {
+            for (const string& containerName : units.at(u).names)
+                plan.entries.at(assigned.at(u)).push_back(containers.at(containerName));
+            if (units.at(u).rowLayout)
+                plan.packedChunks[units.at(u).currentBloom].push_back(make_pair(assigned.at(u), shardChunks[make_pair(units.at(u).currentBloom, assigned.at(u))]++));
+        }
+
+        ManifestVersion version = readManifestVersion(database_path);
+        string key_path = dir_server + dir_server_pubKey;
+        for (int s = 0; s < shards; s++)
+        {
+            string path = shardPath(dir_server, s);
+
+            resetDirectory(path + dir_server_db);
+            for (const ManifestEntry& entry : plan.entries.at(s))
+                linkFile(database_path + entry.name + ".enc", path + dir_server_db + entry.name + ".enc");
+            writeManifest(path + dir_server_db, plan.entries.at(s), version);
+
+            // an outdated key snapshot is left out, a copy made when linking fails is newer than the
+            // text key and loadKeys of the worker would take it for current
+            resetDirectory(path + dir_server_pubKey);
+            for (string keyFile : {"helib_context.key", "helib_public.key"})
+                linkFile(key_path + keyFile, path + dir_server_pubKey + keyFile);
+            if (fs::exists(key_path + public_snapshot_file) && fs::last_write_time(key_path + public_snapshot_file) >= fs::last_write_time(key_path + "helib_public.key"))
+                linkFile(key_path + public_snapshot_file, path + dir_server_pubKey + public_snapshot_file);
+
+            cout << name << " Shard " << s << ": " << plan.entries.at(s).size() - 1 << " database files, " << load.at(s) << " bytes" << endl;
+        }
+
+        return plan;
+    }
+
+    void fanOutQueries(string dir_server, int shards)
+    {
+        string query_path = dir_server + dir_server_qry;
+        for (int s = 0; s < shards; s++)
+        {
+            string path = shardPath(dir_server, s);
+            resetDirectory(path + dir_server_qry);
+            fs::directory_iterator end_itr;
+            for (fs::directory_iterator i(query_path); i != end_itr; ++i)
+                if (fs::is_regular_file(i->status()))
+                    linkFile(i->path().string(), path + dir_server_qry + i->path().filename().string());
+
+            // results of an earlier query must not be merged into this one
+            resetDirectory(path + dir_server_res);
+        }
+    }
+
+    static pid_t startShard(string dir_server, int shard, const ShardOptions& options)
+    {
+        string path = shardPath(dir_server, shard);
+        vector<string> arguments = {"--run", "--dir_server", path};
+        arguments.insert(arguments.end(), options.arguments.begin(), options.arguments.end());
+        if (!options.metrics.empty())
+        {
+            arguments.push_back("--metrics");
+            arguments.push_back(options.metrics + "_shard_" + to_string(shard));
+        }
+
+        // everything is prepared before the fork, the child only redirects its output and executes the worker
+        string command = options.command;
+        boost::replace_all(command, "{shard}", to_string(shard));
+        for (const string& argument : arguments)
+            command += " '" + argument + "'";
+        arguments.insert(arguments.begin(), options.server);
+        vector<char *> argv;
+        for (const string& argument : arguments)
+            argv.push_back(const_cast<char *>(argument.c_str()));
+        argv.push_back(nullptr);
+        string threads = to_string(options.threads);
+        string log = path + "worker.log";
+
+        pid_t pid = fork();
+        if (pid < 0)
+            throw runtime_error("Could not start shard " + to_string(shard));
+
+        if (pid == 0)
+        {
+            if (options.threads > 0)
+                setenv("OMP_NUM_THREADS", threads.c_str(), 1);
+            int fd = open(log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd >= 0)
+            {
+                dup2(fd, STDOUT_FILENO);
+                dup2(fd, STDERR_FILENO);
+                close(fd);
+            }
+
+            if (options.command.empty())
+                execv(argv.front(), argv.data());
+            else
+                execl("/bin/sh", "sh", "-c", command.c_str(), static_cast<char *>(nullptr));
+            _exit(127);
+        }
+        return pid;
+    }
+
+    void runShards(string name, string dir_server, const ShardOptions& options)
+    {
+        vector<pid_t> workers;
+        for (int s = 0; s < options.shards; s++)
+            workers.push_back(startShard(dir_server, s, options));
+
+        int failed = 0;
+        for (int s = 0; s < options.shards; s++)
+        {
+            int status;
+            if (waitpid(workers.at(s), &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            {
+                cout << name << " Shard " << s << " failed, see " << shardPath(dir_server, s) << "worker.log" << endl;
+                failed++;
+            }
+            else
+                cout << name << " Shard " << s << " finished" << endl;
+        }
+
+        if (failed > 0)
+            throw runtime_error(to_string(failed) + " of " + to_string(options.shards) + " shards failed");
+    }
+
+    void mergeResults(string name, string dir_server, const ShardPlan& plan)
+    {
+        string result_path = dir_server + dir_server_res;
+        resetDirectory(result_path);
+
+        // single results are named after their patient or group and taken over as they are
+        vector<ManifestEntry> manifest;
+        set<string> packedResults;
+        for (int s = 0; s < (int) plan.entries.size(); s++)
+        {
+            string shard_result = shardPath(dir_server, s) + dir_server_res;
+            if (!fs::exists(shard_result + manifest_file))
+                throw runtime_error("Shard " + to_string(s) + " wrote no results");
+
+            for (const ManifestEntry& entry : readManifest(shard_result))
+            {
+                if (entry.name.compare(0, string("packed.").length(), "packed.") == 0)
+                {
+                    packedResults.insert(entry.name);
+                    continue;
+                }
+                linkFile(shard_result + entry.name + ".enc", result_path + entry.name + ".enc");
+                manifest.push_back(entry);
+            }
+        }
+
+        // packed results are reassembled chunk by chunk in the order of the whole database
+        for (const string& resultName : packedResults)
+        {
+            const vector<pair<int, uint32_t>>& chunks = plan.packedChunks.at(queryBloom(resultName.substr(string("packed.").length())));
+            map<int, unique_ptr<CtxtContainer>> shardContainers;
+            CtxtContainerWriter container(result_path + resultName + ".enc", static_cast<uint32_t>(chunks.size()));
+            for (const pair<int, uint32_t>& chunk : chunks)
+            {
+                unique_ptr<CtxtContainer>& shardContainer = shardContainers[chunk.first];
+                if (!shardContainer)
+                    shardContainer.reset(new CtxtContainer(shardPath(dir_server, chunk.first) + dir_server_res + resultName + ".enc"));
+                container.append(shardContainer->serialized(chunk.second));
+            }
+            manifest.push_back(ManifestEntry{resultName, static_cast<uint32_t>(chunks.size()), container.close()});
+        }
+
+        writeManifest(result_path, manifest);
+        cout << name << " Merged " << manifest.size() << " results of " << plan.entries.size() << " shards" << endl;
+    }
+}
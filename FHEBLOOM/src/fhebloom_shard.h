@@ -0,0 +1,59 @@
+// File       fhebloom_shard.h
+// Brief      Sharded server coordinator header file of FHEBLOOM approach.
+// 
+// Copyright  BLOOM: Bloom filter based outsourced oblivious matchings
+//            Copyright (C) 2017 Communication and Distributed Systems (COMSYS), RWTH Aachen
+//            
+//            This program is free software: you can redistribute it and/or modify
+//            it under the terms of the GNU Affero General Public License as published
+//            by the Free Software Foundation, either version 3 of the License, or
+//            (at your option) any later version.
+//            
+//            This program is distributed in the hope that it will be useful,
+//            but WITHOUT ANY WARRANTY; without even the implied warranty of
+//            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//            GNU Affero General Public License for more details.
+//            You should have received a copy of the GNU Affero General Public License
+//            along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FHEBLOOM_SHARD_H
+#define FHEBLOOM_SHARD_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include "fhebloom_io.h"
+
+namespace bloomLib
+{
+    // Every shard is an ordinary server directory below the coordinator's, e.g. /tmp/fhebloom_server_shard_0/
+    const static char *dir_server_shard = "fhebloom_server_shard_";
+
+    // Workers of a sharded run, one fhebloom_server --run per shard directory
+    struct ShardOptions
+    {
+        int shards = 1;
+        string server;                  // local fhebloom_server binary
+        string command;                 // shell command replacing the local binary, {shard} is the shard number, e.g. "ssh node{shard} fhebloom_server"
+        int threads = 0;                // OMP_NUM_THREADS of local workers, 0: inherited
+        vector<string> arguments;       // forwarded to every worker
+        string metrics;                 // metrics prefix, every worker writes <prefix>_shard_<i>
+    };
+
+    // Row layout patients are assigned in blocks of nslots patients, so every chunk of a shard's packed result
+    // is one chunk of the packed result over the whole database and merging only copies ciphertexts.
+    // Column layout groups are assigned whole.
+    struct ShardPlan
+    {
+        vector<vector<ManifestEntry>> entries;                      // database containers of every shard
+        map<string, vector<pair<int, uint32_t>>> packedChunks;      // per Bloom filter size: shard and shard chunk of every packed chunk
+    };
+
+    string shardPath(string dir_server, int shard);
+    ShardPlan partitionDatabase(string name, string dir_server, int shards);
+    void fanOutQueries(string dir_server, int shards);
+    void runShards(string name, string dir_server, const ShardOptions& options);
+    void mergeResults(string name, string dir_server, const ShardPlan& plan);
+}
+
+#endif //FHEBLOOM_SHARD_H
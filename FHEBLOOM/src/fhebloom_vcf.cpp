@@ -0,0 +1,315 @@
+// File       fhebloom_vcf.cpp
+// Brief      VCF parser and pybloom_live compatible Bloom filter builder class file of FHEBLOOM approach.
+// 
+// Copyright  BLOOM: Bloom filter based outsourced oblivious matchings
+//            Copyright (C) 2017 Communication and Distributed Systems (COMSYS), RWTH Aachen
+//            
+//            This program is free software: you can redistribute it and/or modify
+//            it under the terms of the GNU Affero General Public License as published
+//            by the Free Software Foundation, either version 3 of the License, or
+//            (at your option) any later version.
+//            
+//            This program is distributed in the hope that it will be useful,
+//            but WITHOUT ANY WARRANTY; without even the implied warranty of
+//            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//            GNU Affero General Public License for more details.
+//            You should have received a copy of the GNU Affero General Public License
+//            along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <fstream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "fhebloom_vcf.h"
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+namespace bloomLib
+{
+    // lines are parsed in blocks of this size, a line belongs to the block its first byte is in
+    const static size_t vcf_block_size = 1 << 20;
+
+    BloomParameters bloomParameters(long capacity, double errorRate, long blockBits)
+    {
+        // same floating point expressions as pybloom_live, otherwise the slice size may differ by one
+        BloomParameters params;
+        params.capacity = capacity;
+        params.errorRate = errorRate;
+        params.numberSlices = static_cast<long>(ceil(log(1.0 / errorRate) / log(2.0)));
+        params.bitsPerSlice = static_cast<long>(ceil((capacity * fabs(log(errorRate))) / (params.numberSlices * pow(log(2.0), 2))));
+        params.blockBits = max(0L, blockBits);
+        params.numberBlocks = 0;
+        params.hashes = params.numberSlices;
+
+        if (!params.blocked())
+            return params;
+
+        // blocks are unevenly loaded, so start at the standard size and add blocks until the best
+        // number of hashes reaches the error rate
+        for (params.numberBlocks = max(1L, (params.numberSlices * params.bitsPerSlice + params.blockBits - 1) / params.blockBits); ; params.numberBlocks++)
+        {
+            double best = 1.0;
+            for (long k = 1; k <= 2 * params.numberSlices; k++)
+            {
+                double rate = blockedFalsePositiveRate(capacity, params.numberBlocks, params.blockBits, k);
+                if (rate < best)
+                {
+                    best = rate;
+                    params.hashes = k;
+                }
+            }
+            // whole bytes, so no padding bits form an extra chunk
+            if (best <= errorRate && (params.numberBlocks * params.blockBits) % 8 == 0)
+                return params;
+        }
+    }
+
+    double falsePositiveRate(long capacity, long numberSlices, long bitsPerSlice)
+    {
+        // every slice holds one bit of every SNP
+        return pow(1.0 - pow(1.0 - 1.0 / bitsPerSlice, static_cast<double>(capacity)), static_cast<double>(numberSlices));
+    }
+
+    double blockedFalsePositiveRate(long capacity, long numberBlocks, long blockBits, long hashes)
+    {
+        // the SNPs per block are Poisson distributed, sum the rate of a block holding i SNPs
+        double lambda = static_cast<double>(capacity) / numberBlocks;
+        long last = static_cast<long>(lambda + 20 * sqrt(lambda) + 50);
+
+        double rate = 0;
+        for (long i = 0; i <= last; i++)
+        {
+            double probability = exp(i * log(lambda) - lambda - lgamma(i + 1.0));
+            rate += probability * pow(1.0 - pow(1.0 - 1.0 / blockBits, static_cast<double>(i * hashes)), static_cast<double>(hashes));
+        }
+        return rate;
+    }
+
+    BloomBuilder::BloomBuilder(long capacity, double errorRate, long blockBits) : params(bloomParameters(capacity, errorRate, blockBits))
+    {
+        // pybloom_live's make_hashfuncs: value width from the slice size, hash from the bits needed,
+        // a blocked filter needs one more value to pick the block
+        long valueRange = params.blocked() ? max(params.numberBlocks, params.blockBits) : params.bitsPerSlice;
+        numberValues = params.blocked() ? params.hashes + 1 : params.numberSlices;
+
+        if (valueRange >= (1L << 31))
+            valueSize = 8;
+        else if (valueRange >= (1L << 15))
+            valueSize = 4;
+        else
+            valueSize = 2;
+
+        long totalHashBits = 8 * numberValues * valueSize;
+        if (totalHashBits > 384)
+            hashFunction = EVP_sha512();
+        else if (totalHashBits > 256)
+            hashFunction = EVP_sha384();
+        else if (totalHashBits > 160)
+            hashFunction = EVP_sha256();
+        else if (totalHashBits > 128)
+            hashFunction = EVP_sha1();
+        else
+            hashFunction = EVP_md5();
+
+        long valuesPerSalt = EVP_MD_size(hashFunction) / valueSize;
+        long numberSalts = (numberValues + valuesPerSalt - 1) / valuesPerSalt;
+
+        // salt i is the hash state after hashing H(pack('I', i))
+        for (uint32_t i = 0; i < (uint32_t) numberSalts; i++)
+        {
+            unsigned char packed[4] = {static_cast<unsigned char>(i), static_cast<unsigned char>(i >> 8), static_cast<unsigned char>(i >> 16), static_cast<unsigned char>(i >> 24)};
+            unsigned char digest[EVP_MAX_MD_SIZE];
+            unsigned int digestSize = 0;
+            EVP_Digest(packed, sizeof(packed), digest, &digestSize, hashFunction, nullptr);
+
+            EVP_MD_CTX *salt = EVP_MD_CTX_new();
+            EVP_DigestInit_ex(salt, hashFunction, nullptr);
+            EVP_DigestUpdate(salt, digest, digestSize);
+            salts.push_back(salt);
+        }
+    }
+
+    BloomBuilder::~BloomBuilder()
+    {
+        for (EVP_MD_CTX *salt : salts)
+            EVP_MD_CTX_free(salt);
+    }
+
+    void BloomBuilder::add(EVP_MD_CTX *ctx, const char *key, size_t length, vector<unsigned char>& bits) const
+    {
+        long value = 0;
+        uint64_t block = 0;
+        for (EVP_MD_CTX *salt : salts)
+        {
+            unsigned char digest[EVP_MAX_MD_SIZE];
+            unsigned int digestSize = 0;
+            EVP_MD_CTX_copy_ex(ctx, salt);
+            EVP_DigestUpdate(ctx, key, length);
+            EVP_DigestFinal_ex(ctx, digest, &digestSize);
+
+            // struct.unpack with native (little endian) byte order
+            for (size_t offset = 0; offset + valueSize <= digestSize && value < numberValues; offset += valueSize, value++)
+            {
+                uint64_t hash = 0;
+                for (size_t b = 0; b < valueSize; b++)
+                    hash |= static_cast<uint64_t>(digest[offset + b]) << (8 * b);
+
+                uint64_t position;
+                unsigned char mask;
+                if (params.blocked())
+                {
+                    if (value == 0)
+                    {
+                        block = hash % params.numberBlocks;
+                        continue;
+                    }
+                    position = block * params.blockBits + hash % params.blockBits;
+                    mask = static_cast<unsigned char>(0x80 >> (position % 8));
+                }
+                else
+                {
+                    position = value * params.bitsPerSlice + hash % params.bitsPerSlice;
+                    mask = static_cast<unsigned char>(1 << (position % 8));
+                }
+
+                #pragma omp atomic
+                bits[position / 8] |= mask;
+            }
+        }
+    }
+
+    long BloomBuilder::addVcf(string filename, vector<unsigned char>& bits) const
+    {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw runtime_error("Cannot open VCF file " + filename);
+
+        struct stat fileStat;
+        fstat(fd, &fileStat);
+        size_t length = static_cast<size_t>(fileStat.st_size);
+        if (length == 0)
+        {
+            close(fd);
+            return 0;
+        }
+
+        void *mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED)
+            throw runtime_error("Cannot map VCF file " + filename);
+        madvise(mapping, length, MADV_SEQUENTIAL);
+        const char *data = static_cast<const char *>(mapping);
+
+        long snps = 0;
+        long malformed = 0;
+        size_t firstMalformed = length;   // offset of the first line with less than 5 fields
+        long numberBlocks = static_cast<long>((length + vcf_block_size - 1) / vcf_block_size);
+
+        #pragma omp parallel reduction(+:snps,malformed) reduction(min:firstMalformed)
+        {
+            EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+            string key;
+
+            #pragma omp for schedule(dynamic,1)
+            for (long block = 0; block < numberBlocks; block++)
+            {
+                size_t position = block * vcf_block_size;
+                size_t blockEnd = min(length, position + vcf_block_size);
+
+                // skip the line that started in the previous block
+                if (position > 0 && data[position - 1] != '\n')
+                {
+                    const char *next = static_cast<const char *>(memchr(data + position, '\n', length - position));
+                    position = next == nullptr ? length : next - data + 1;
+                }
+
+                while (position < blockEnd)
+                {
+                    const char *next = static_cast<const char *>(memchr(data + position, '\n', length - position));
+                    size_t lineEnd = next == nullptr ? length : next - data;
+                    size_t lineBegin = position;
+                    position = lineEnd + 1;
+
+                    if (data[lineBegin] == '#')
+                        continue;
+
+                    // Python's str.strip(), then split on tabs
+                    while (lineBegin < lineEnd && isspace(static_cast<unsigned char>(data[lineBegin])))
+                        lineBegin++;
+                    while (lineEnd > lineBegin && isspace(static_cast<unsigned char>(data[lineEnd - 1])))
+                        lineEnd--;
+
+                    const char *fields[6];
+                    size_t fieldLengths[5];
+                    int numberFields = 0;
+                    fields[0] = data + lineBegin;
+                    for (size_t i = lineBegin; i <= lineEnd && numberFields < 5; i++)
+                    {
+                        if (i == lineEnd || data[i] == '\t')
+                        {
+                            fieldLengths[numberFields] = data + i - fields[numberFields];
+                            fields[++numberFields] = data + i + 1;
+                        }
+                    }
+
+                    if (numberFields < 5)
+                    {
+                        malformed++;
+                        firstMalformed = min(firstMalformed, lineBegin);
+                        continue;
+                    }
+
+                    // CHROM + POS + REF + ALT
+                    key.assign(fields[0], fieldLengths[0]);
+                    key.append(fields[1], fieldLengths[1]);
+                    key.append(fields[3], fieldLengths[3]);
+                    key.append(fields[4], fieldLengths[4]);
+                    add(ctx, key.data(), key.size(), bits);
+                    snps++;
+                }
+            }
+
+            EVP_MD_CTX_free(ctx);
+        }
+
+        long firstLine = malformed > 0 ? 1 + count(data, data + firstMalformed, '\n') : 0;
+        munmap(mapping, length);
+
+        if (malformed > 0)
+            throw runtime_error(filename + " has " + to_string(malformed) + " lines with less than 5 fields, the first in line " + to_string(firstLine));
+
+        return snps;
+    }
+
+    vector<unsigned char> BloomBuilder::buildFromVcf(string filename) const
+    {
+        vector<unsigned char> bits(params.numberBytes(), 0);
+        addVcf(filename, bits);
+        return bits;
+    }
+
+    void writeBloomFile(string filename, const vector<unsigned char>& bits)
+    {
+        fstream bloomFile(filename, fstream::out|fstream::trunc|fstream::binary);
+        if (!bloomFile.is_open())
+            throw runtime_error("Cannot write Bloom filter " + filename);
+        bloomFile.write(reinterpret_cast<const char *>(bits.data()), bits.size());
+    }
+
+    vector<string> enumerateVcf(string path, string pattern)
+    {
+        vector<string> vcfList;
+        for (fs::directory_iterator it(path); it != fs::directory_iterator(); it++)
+            if (fs::is_regular_file(it->path()) && fnmatch(pattern.c_str(), it->path().filename().c_str(), FNM_PERIOD) == 0)
+                vcfList.push_back(it->path().string());
+        return vcfList;
+    }
+}
@@ -0,0 +1,92 @@
+// File       fhebloom_vcf.h
+// Brief      VCF parser and pybloom_live compatible Bloom filter builder header file of FHEBLOOM approach.
+// 
+// Copyright  BLOOM: Bloom filter based outsourced oblivious matchings
+//            Copyright (C) 2017 Communication and Distributed Systems (COMSYS), RWTH Aachen
+//            
+//            This program is free software: you can redistribute it and/or modify
+//            it under the terms of the GNU Affero General Public License as published
+//            by the Free Software Foundation, either version 3 of the License, or
+//            (at your option) any later version.
+//            
+//            This program is distributed in the hope that it will be useful,
+//            but WITHOUT ANY WARRANTY; without even the implied warranty of
+//            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//            GNU Affero General Public License for more details.
+//            You should have received a copy of the GNU Affero General Public License
+//            along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FHEBLOOM_VCF_H
+#define FHEBLOOM_VCF_H
+
+#include <cstdint>
+#include <openssl/evp.h>
+#include <string>
+#include <vector>
+
+namespace bloomLib
+{
+    // Same defaults as bloomfiltering_config.py
+    const static long vcf_capacity = 10000;
+    const static double vcf_error_prob = 1/16384.;
+
+    // Geometry of a pybloom_live BloomFilter(capacity, error_rate), or of the blocked variant if blockBits > 0:
+    // every SNP sets all its hashes bits inside one of numberBlocks blocks of blockBits bits
+    struct BloomParameters
+    {
+        long capacity;
+        double errorRate;
+        long numberSlices;
+        long bitsPerSlice;
+        long blockBits;
+        long numberBlocks;
+        long hashes;
+
+        bool blocked() const { return blockBits > 0; }
+        long numberBits() const { return blocked() ? numberBlocks * blockBits : numberSlices * bitsPerSlice; }
+        size_t numberBytes() const { return static_cast<size_t>((numberBits() + 7) / 8); }
+    };
+
+    BloomParameters bloomParameters(long capacity, double errorRate, long blockBits = 0);
+
+    // Expected false positive rate after inserting capacity SNPs
+    double falsePositiveRate(long capacity, long numberSlices, long bitsPerSlice);
+    double blockedFalsePositiveRate(long capacity, long numberBlocks, long blockBits, long hashes);
+
+    // Builds Bloom filters bit-identical to bloomfiltering_config.writeToFile: the SNP key is
+    // CHROM+POS+REF+ALT, the bytes are bitarray's little endian layout written by tofile().
+    // Blocked filters use the same salted hashes, the first value picks the block, and are
+    // stored MSB first like BloomFile decodes them, so block b is exactly chunk b if blockBits == nslots.
+    class BloomBuilder
+    {
+    public:
+        BloomBuilder(long capacity, double errorRate, long blockBits = 0);
+        ~BloomBuilder();
+        BloomBuilder(const BloomBuilder&) = delete;
+        BloomBuilder& operator=(const BloomBuilder&) = delete;
+
+        const BloomParameters& parameters() const { return params; }
+
+        // thread-safe, bits are set with atomic ors
+        void add(EVP_MD_CTX *ctx, const char *key, size_t length, std::vector<unsigned char>& bits) const;
+
+        // parses the memory mapped VCF in parallel blocks, returns the number of SNPs added
+        long addVcf(std::string filename, std::vector<unsigned char>& bits) const;
+
+        std::vector<unsigned char> buildFromVcf(std::string filename) const;
+
+    private:
+        BloomParameters params;
+        const EVP_MD *hashFunction;
+        size_t valueSize;                  // 2, 4 or 8 bytes per unpacked hash value
+        long numberValues;                 // hash values needed per SNP
+        std::vector<EVP_MD_CTX *> salts;   // hash state after the salt, copied for every key
+    };
+
+    void writeBloomFile(std::string filename, const std::vector<unsigned char>& bits);
+
+    // VCF files matching the glob pattern in directory order, like glob.glob in bloomfiltering_database.py
+    std::vector<std::string> enumerateVcf(std::string path, std::string pattern);
+}
+
+#endif //FHEBLOOM_VCF_H
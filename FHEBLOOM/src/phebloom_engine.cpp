@@ -0,0 +1,246 @@
+// File       phebloom_engine.cpp
+// Brief      Native Paillier column aggregation engine class file of PHEBLOOM approach.
+// 
+// Copyright  BLOOM: Bloom filter based outsourced oblivious matchings
+//            Copyright (C) 2017 Communication and Distributed Systems (COMSYS), RWTH Aachen
+//            
+//            This program is free software: you can redistribute it and/or modify
+//            it under the terms of the GNU Affero General Public License as published
+//            by the Free Software Foundation, either version 3 of the License, or
+//            (at your option) any later version.
+//            
+//            This program is distributed in the hope that it will be useful,
+//            but WITHOUT ANY WARRANTY; without even the implied warranty of
+//            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//            GNU Affero General Public License for more details.
+//            You should have received a copy of the GNU Affero General Public License
+//            along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#include <omp.h>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+#include "phebloom_engine.h"
+
+using namespace std;
+
+static_assert(GMP_NAIL_BITS == 0, "Montgomery multiplication needs full limbs");
+
+namespace bloomLib
+{
+    // rows aggregated per task, a block of accumulators stays in cache while the selected columns are walked
+    const static size_t aggregation_block = 64;
+
+    static thread_local string lastError;
+
+    PaillierEngine::PaillierEngine(const unsigned char *modulusData, size_t modulusSize) : modulusBytes(modulusSize), numberRows(0), numberColumns(0)
+    {
+        mpz_init(modulus);
+        mpz_import(modulus, modulusSize, 1, 1, 0, 0, modulusData);
+        if (mpz_even_p(modulus) || mpz_cmp_ui(modulus, 1) <= 0)
+        {
+            mpz_clear(modulus);
+            throw invalid_argument("Paillier modulus must be odd and greater than one");
+        }
+
+        limbs = mpz_size(modulus);
+        modulusLimbs.assign(limbs, 0);
+        for (size_t i = 0; i < limbs; i++)
+            modulusLimbs.at(i) = mpz_getlimbn(modulus, i);
+
+        // Newton iteration doubles the correct low bits of the inverse of an odd limb each step
+        mp_limb_t x = modulusLimbs.at(0);
+        for (int i = 0; i < 7; i++)
+            x *= 2 - modulusLimbs.at(0) * x;
+        inverse = -x;
+    }
+
+    PaillierEngine::~PaillierEngine()
+    {
+        mpz_clear(modulus);
+    }
+
+    // result = a * b / R mod n^2 with R = 2^(limbs * GMP_NUMB_BITS), result may alias a or b, scratch holds 2 * limbs + 1 limbs
+    void PaillierEngine::montgomeryMultiply(mp_limb_t *result, const mp_limb_t *a, const mp_limb_t *b, mp_limb_t *scratch) const
+    {
+        const mp_limb_t *n = modulusLimbs.data();
+
+        mpn_mul_n(scratch, a, b, static_cast<mp_size_t>(limbs));
+        scratch[2 * limbs] = 0;
+
+        // every round clears the lowest limb by adding a multiple of n^2
+        for (size_t i = 0; i < limbs; i++)
+        {
+            mp_limb_t m = scratch[i] * inverse;
+            mp_limb_t carry = mpn_addmul_1(scratch + i, n, static_cast<mp_size_t>(limbs), m);
+            scratch[2 * limbs] += mpn_add_1(scratch + i + limbs, scratch + i + limbs, static_cast<mp_size_t>(limbs - i), carry);
+        }
+
+        if (scratch[2 * limbs] != 0 || mpn_cmp(scratch + limbs, n, static_cast<mp_size_t>(limbs)) >= 0)
+            mpn_sub_n(result, scratch + limbs, n, static_cast<mp_size_t>(limbs));
+        else
+            copy(scratch + limbs, scratch + 2 * limbs, result);
+    }
+
+    void PaillierEngine::toMontgomery(const mpz_t value, mpz_t scratch, mp_limb_t *result) const
+    {
+        mpz_mul_2exp(scratch, value, limbs * GMP_NUMB_BITS);
+        mpz_mod(scratch, scratch, modulus);
+        for (size_t i = 0; i < limbs; i++)
+            result[i] = mpz_getlimbn(scratch, i);
+    }
+
+    void PaillierEngine::addColumn(const unsigned char *ciphertexts, size_t count, size_t width)
+    {
+        if (numberColumns > 0 && count != numberRows)
+            throw invalid_argument("Column of " + to_string(count) + " ciphertexts, the database has " + to_string(numberRows) + " rows");
+
+        size_t offset = data.size();
+        data.resize(offset + count * limbs);
+
+        atomic<bool> outOfRange(false);
+        #pragma omp parallel
+        {
+            mpz_t value, scratch;
+            mpz_init(value);
+            mpz_init(scratch);
+
+            #pragma omp for schedule(static)
+            for (long r = 0; r < (long) count; r++)
+            {
+                mpz_import(value, width, 1, 1, 0, 0, ciphertexts + r * width);
+                if (mpz_cmp(value, modulus) >= 0)
+                    outOfRange = true;
+                else
+                    toMontgomery(value, scratch, data.data() + offset + r * limbs);
+            }
+
+            mpz_clear(scratch);
+            mpz_clear(value);
+        }
+
+        if (outOfRange)
+        {
+            data.resize(offset);
+            throw invalid_argument("Ciphertext not below the Paillier modulus");
+        }
+
+        numberRows = count;
+        numberColumns++;
+    }
+
+    void PaillierEngine::aggregate(const unsigned char *query, size_t length, unsigned char *results, size_t width) const
+    {
+        if (width < modulusBytes)
+            throw invalid_argument("Result width of " + to_string(width) + " bytes, ciphertexts need " + to_string(modulusBytes));
+
+        vector<size_t> selected;
+        for (size_t c = 0; c < min(length, numberColumns); c++)
+            if (query[c])
+                selected.push_back(c);
+        if (selected.empty())
+            throw invalid_argument("The query selects no column");
+
+        size_t blocks = (numberRows + aggregation_block - 1) / aggregation_block;
+
+        #pragma omp parallel
+        {
+            vector<mp_limb_t> accumulators(aggregation_block * limbs);
+            vector<mp_limb_t> scratch(2 * limbs + 1);
+            vector<mp_limb_t> one(limbs, 0), reduced(limbs);
+            one.at(0) = 1;
+            mpz_t value;
+            mpz_init(value);
+
+            #pragma omp for schedule(dynamic,1)
+            for (long b = 0; b < (long) blocks; b++)
+            {
+                size_t first = b * aggregation_block;
+                size_t count = min(aggregation_block, numberRows - first);
+
+                const mp_limb_t *column = data.data() + (selected.front() * numberRows + first) * limbs;
+                copy(column, column + count * limbs, accumulators.begin());
+
+                for (size_t s = 1; s < selected.size(); s++)
+                {
+                    column = data.data() + (selected.at(s) * numberRows + first) * limbs;
+                    for (size_t r = 0; r < count; r++)
+                        montgomeryMultiply(accumulators.data() + r * limbs, accumulators.data() + r * limbs, column + r * limbs, scratch.data());
+                }
+
+                // multiplying with 1 leaves the Montgomery form, results are big-endian and padded to width like the inputs
+                for (size_t r = 0; r < count; r++)
+                {
+                    montgomeryMultiply(reduced.data(), accumulators.data() + r * limbs, one.data(), scratch.data());
+                    mpz_import(value, limbs, -1, sizeof(mp_limb_t), 0, 0, reduced.data());
+                    unsigned char *result = results + (first + r) * width;
+                    size_t size = (mpz_sizeinbase(value, 2) + 7) / 8;
+                    memset(result, 0, width - size);
+                    mpz_export(result + width - size, nullptr, 1, 1, 0, 0, value);
+                }
+            }
+
+            mpz_clear(value);
+        }
+    }
+}
+
+extern "C"
+{
+    void *phebloom_engine_create(const unsigned char *modulus, size_t modulusBytes)
+    {
+        try
+        {
+            return new bloomLib::PaillierEngine(modulus, modulusBytes);
+        }
+        catch (const exception& e)
+        {
+            bloomLib::lastError = e.what();
+            return nullptr;
+        }
+    }
+
+    int phebloom_engine_add_column(void *engine, const unsigned char *ciphertexts, size_t count, size_t width)
+    {
+        try
+        {
+            static_cast<bloomLib::PaillierEngine *>(engine)->addColumn(ciphertexts, count, width);
+            return 0;
+        }
+        catch (const exception& e)
+        {
+            bloomLib::lastError = e.what();
+            return -1;
+        }
+    }
+
+    int phebloom_engine_aggregate(const void *engine, const unsigned char *query, size_t length, unsigned char *results, size_t width)
+    {
+        try
+        {
+            static_cast<const bloomLib::PaillierEngine *>(engine)->aggregate(query, length, results, width);
+            return 0;
+        }
+        catch (const exception& e)
+        {
+            bloomLib::lastError = e.what();
+            return -1;
+        }
+    }
+
+    size_t phebloom_engine_rows(const void *engine)
+    {
+        return static_cast<const bloomLib::PaillierEngine *>(engine)->rows();
+    }
+
+    void phebloom_engine_destroy(void *engine)
+    {
+        delete static_cast<bloomLib::PaillierEngine *>(engine);
+    }
+
+    const char *phebloom_engine_error()
+    {
+        return bloomLib::lastError.c_str();
+    }
+}
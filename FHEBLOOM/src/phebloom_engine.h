@@ -0,0 +1,76 @@
+// File       phebloom_engine.h
+// Brief      Native Paillier column aggregation engine header file of PHEBLOOM approach.
+// 
+// Copyright  BLOOM: Bloom filter based outsourced oblivious matchings
+//            Copyright (C) 2017 Communication and Distributed Systems (COMSYS), RWTH Aachen
+//            
+//            This program is free software: you can redistribute it and/or modify
+//            it under the terms of the GNU Affero General Public License as published
+//            by the Free Software Foundation, either version 3 of the License, or
+//            (at your option) any later version.
+//            
+//            This program is distributed in the hope that it will be useful,
+//            but WITHOUT ANY WARRANTY; without even the implied warranty of
+//            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+//            GNU Affero General Public License for more details.
+//            You should have received a copy of the GNU Affero General Public License
+//            along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef PHEBLOOM_ENGINE_H
+#define PHEBLOOM_ENGINE_H
+
+#include <gmp.h>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace bloomLib
+{
+    // Encrypted Bloom filter columns of the PHEBLOOM database, all columns hold the same number of Paillier ciphertexts.
+    // Ciphertexts are kept in Montgomery form modulo n^2, the limbs of one column back to back,
+    // so adding columns (multiplying their ciphertexts) needs no division.
+    class PaillierEngine
+    {
+    public:
+        PaillierEngine(const unsigned char *modulus, size_t modulusBytes);   // n^2, big-endian
+        ~PaillierEngine();
+        PaillierEngine(const PaillierEngine&) = delete;
+        PaillierEngine& operator=(const PaillierEngine&) = delete;
+
+        // count ciphertexts of width big-endian bytes each
+        void addColumn(const unsigned char *ciphertexts, size_t count, size_t width);
+        // results[r] = product of row r of all columns c with query[c] != 0, rows() ciphertexts of width bytes
+        void aggregate(const unsigned char *query, size_t length, unsigned char *results, size_t width) const;
+
+        size_t rows() const { return numberRows; }
+        size_t columns() const { return numberColumns; }
+        size_t bytes() const { return modulusBytes; }
+
+    private:
+        void montgomeryMultiply(mp_limb_t *result, const mp_limb_t *a, const mp_limb_t *b, mp_limb_t *scratch) const;
+        void toMontgomery(const mpz_t value, mpz_t scratch, mp_limb_t *result) const;
+
+        mpz_t modulus;
+        std::vector<mp_limb_t> modulusLimbs;
+        mp_limb_t inverse;              // -n^-2 mod 2^GMP_NUMB_BITS
+        size_t limbs;
+        size_t modulusBytes;
+        size_t numberRows;
+        size_t numberColumns;
+        std::vector<mp_limb_t> data;
+    };
+}
+
+// C interface for ctypes, see PHEBLOOM/native.py. Functions returning int give 0 on success and -1 on failure,
+// phebloom_engine_error then describes the last failure of the calling thread.
+extern "C"
+{
+    void *phebloom_engine_create(const unsigned char *modulus, size_t modulusBytes);
+    int phebloom_engine_add_column(void *engine, const unsigned char *ciphertexts, size_t count, size_t width);
+    int phebloom_engine_aggregate(const void *engine, const unsigned char *query, size_t length, unsigned char *results, size_t width);
+    size_t phebloom_engine_rows(const void *engine);
+    void phebloom_engine_destroy(void *engine);
+    const char *phebloom_engine_error();
+}
+
+#endif //PHEBLOOM_ENGINE_H
@@ -0,0 +1,80 @@
+"""
+ File       native.py
+ Brief      Binding of the native Paillier column aggregation engine (FHEBLOOM target phebloom_engine)
+ 
+ Copyright  BLOOM: Bloom filter based outsourced oblivious matchings
+            Copyright (C) 2017 Communication and Distributed Systems (COMSYS), RWTH Aachen
+            
+            This program is free software: you can redistribute it and/or modify
+            it under the terms of the GNU Affero General Public License as published
+            by the Free Software Foundation, either version 3 of the License, or
+            (at your option) any later version.
+            
+            This program is distributed in the hope that it will be useful,
+            but WITHOUT ANY WARRANTY; without even the implied warranty of
+            MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+            GNU Affero General Public License for more details.
+            You should have received a copy of the GNU Affero General Public License
+            along with this program. If not, see <http://www.gnu.org/licenses/>.        
+"""
+
+import binascii
+import ctypes
+from gmpy import mpz
+from bitarray import bitarray
+
+class NativeAggregator(object):
+    """
+        Keeps the encrypted Bloom filter columns of the database in libphebloom_engine.so
+        and adds the columns selected by a query on all cores (OMP_NUM_THREADS).
+        
+        Ciphertexts cross the interface as big-endian byte strings padded to the size of n^2.
+        
+        *library*   path to libphebloom_engine.so
+        *nsq*       n^2 of the Paillier public key
+    """
+    def __init__(self, library, nsq):
+        self.lib = ctypes.CDLL(library)
+        self.lib.phebloom_engine_create.restype = ctypes.c_void_p
+        self.lib.phebloom_engine_create.argtypes = [ctypes.c_char_p, ctypes.c_size_t]
+        self.lib.phebloom_engine_add_column.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_size_t, ctypes.c_size_t]
+        self.lib.phebloom_engine_aggregate.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_size_t, ctypes.c_char_p, ctypes.c_size_t]
+        self.lib.phebloom_engine_rows.restype = ctypes.c_size_t
+        self.lib.phebloom_engine_rows.argtypes = [ctypes.c_void_p]
+        self.lib.phebloom_engine_destroy.argtypes = [ctypes.c_void_p]
+        self.lib.phebloom_engine_error.restype = ctypes.c_char_p
+        
+        self.width = (len('%x' % long(nsq)) + 1) / 2
+        self.engine = self.lib.phebloom_engine_create(self.toBytes(nsq), self.width)
+        if not self.engine:
+            raise RuntimeError(self.lib.phebloom_engine_error())
+    
+    def __del__(self):
+        if getattr(self, 'engine', None):
+            self.lib.phebloom_engine_destroy(self.engine)
+            
+    def toBytes(self, C):
+        return binascii.unhexlify('%0*x' % (2*self.width, long(C)))
+    
+    def check(self, status):
+        if status != 0:
+            raise RuntimeError(self.lib.phebloom_engine_error())
+    
+    def addColumn(self, Col):
+        self.check(self.lib.phebloom_engine_add_column(self.engine, ''.join(self.toBytes(C) for C in Col), len(Col), self.width))
+        
+    def match_and_aggregate(self, bfs_Q):
+        """
+            Same result as Task3Server.match_and_aggregate: the product of the selected columns per row.
+        """
+        if isinstance(bfs_Q, bitarray):
+            query = bfs_Q.unpack()
+        else:
+            query = str(bytearray(1 if bit else 0 for bit in bfs_Q))
+        
+        rows = self.lib.phebloom_engine_rows(self.engine)
+        results = ctypes.create_string_buffer(rows * self.width)
+        self.check(self.lib.phebloom_engine_aggregate(self.engine, query, len(query), results, self.width))
+        
+        raw = results.raw
+        return [mpz(binascii.hexlify(raw[i*self.width:(i+1)*self.width]), 16) for i in range(rows)]
@@ -21,14 +21,17 @@
 
 import argparse
 import paillier
+from native import NativeAggregator
 from network import TCPServer
 from util import Timer, printNetworkStatistics
 
 class Task3Server:
-    def __init__(self, peer):
+    def __init__(self, peer, engine=None):
         self.peer = peer        
         self.setup_keys()
         self.benchmarks = {}
+        self.engine = engine
+        self.native = None
         
     def setup_keys(self):
         pubkey = self.peer.recv()
@@ -49,8 +52,19 @@ class Task3Server:
                         for col in tmp: 
                             col.append(col[0])
                     self.enc_bfs_DB += tmp
+        
+        if self.engine:
+            # the columns only live in the engine from now on
+            with Timer(logstring="Load DB into native engine"):
+                self.native = NativeAggregator(self.engine, self.P.nsq)
+                for col in self.enc_bfs_DB:
+                    self.native.addColumn(col)
+                self.enc_bfs_DB = []
             
     def match_and_aggregate(self, bfs_Q):
+        if self.native:
+            return self.native.match_and_aggregate(bfs_Q)
+        
         # Select columns
         Cols = []
         cnt = 0
@@ -85,13 +99,14 @@ if __name__ == "__main__":
     parser.add_argument("-a", "--address", default="127.0.0.1", help="address to listen to [default: localhost]")
     parser.add_argument("-p", "--port", default=8123, type=int, help="port to listen on [default: 8213]")
     parser.add_argument("--qrycnt", type=int, default=3, help="Expected number of query repetitions [default: 3]")
+    parser.add_argument("--engine", default=None, help="Path to libphebloom_engine.so (FHEBLOOM target phebloom_engine), selected columns are then added natively on all cores [default: aggregate in Python]")
     parser.add_argument("--blowup", type=int, default=1, help="Duplicate rows by this factor [default: 1] (This option can be used to produce synthetic large data sets on the server without transferring them from the client, e.g., to avoid large setup overheads during eval of online overheads)")         
     
     args = parser.parse_args()
     
     with Timer(logstring="Init server:"):
         peer = TCPServer(args.address, args.port)
-        t3s = Task3Server(peer)
+        t3s = Task3Server(peer, args.engine)
     
     t3s.setup(args.blowup)    
     t3s.run(args.qrycnt)